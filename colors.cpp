@@ -0,0 +1,162 @@
+#include "colors.h"
+
+#include <ncurses.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <list>
+#include <unordered_map>
+
+#include "immersion.h"
+
+using namespace std;
+
+struct pair_entry {
+  short pair;
+  list<uint64_t>::iterator use;
+  unsigned frame;  // last frame it was used in
+};
+
+static size_t capacity = 0;
+static unsigned frame = 0;
+static unordered_map<uint64_t, pair_entry> pairs;
+static list<uint64_t> uses;  // most recently used first
+
+// Colors 0-15 as xterm shows them
+static const int kBasicColors[16] = {
+    0x000000, 0xcd0000, 0x00cd00, 0xcdcd00, 0x0000ee, 0xcd00cd,
+    0x00cdcd, 0xe5e5e5, 0x7f7f7f, 0xff0000, 0x00ff00, 0xffff00,
+    0x5c5cff, 0xff00ff, 0x00ffff, 0xffffff,
+};
+
+static const int kCubeLevels[6] = {0, 95, 135, 175, 215, 255};
+
+static int palette_rgb(int index) {
+  if (index < 16) {
+    return kBasicColors[index];
+  }
+  if (index < 232) {
+    index -= 16;
+    return kCubeLevels[index / 36] << 16 | kCubeLevels[index / 6 % 6] << 8 |
+           kCubeLevels[index % 6];
+  }
+  auto level = 8 + (index - 232) * 10;
+  return level << 16 | level << 8 | level;
+}
+
+static int distance(int rgb1, int rgb2) {
+  auto dr = (rgb1 >> 16 & 0xff) - (rgb2 >> 16 & 0xff);
+  auto dg = (rgb1 >> 8 & 0xff) - (rgb2 >> 8 & 0xff);
+  auto db = (rgb1 & 0xff) - (rgb2 & 0xff);
+  return dr * dr * 2 + dg * dg * 4 + db * db * 3;
+}
+
+// Palette index below `colors` that looks closest to `rgb`. In a 256 color
+// palette only the nearest cube and gray entries need to be compared.
+static int nearest_color(int rgb, int colors) {
+  if (colors >= 256) {
+    auto level = [](int v) {
+      return (int)(min_element(begin(kCubeLevels), end(kCubeLevels),
+                               [&](int a, int b) {
+                                 return abs(a - v) < abs(b - v);
+                               }) -
+                   kCubeLevels);
+    };
+    auto cube = 16 + level(rgb >> 16 & 0xff) * 36 +
+                level(rgb >> 8 & 0xff) * 6 + level(rgb & 0xff);
+    auto avg = ((rgb >> 16 & 0xff) + (rgb >> 8 & 0xff) + (rgb & 0xff)) / 3;
+    auto gray = 232 + min(max((avg - 3) / 10, 0), 23);
+    return distance(palette_rgb(gray), rgb) < distance(palette_rgb(cube), rgb)
+               ? gray
+               : cube;
+  }
+  auto best = 0;
+  for (auto i = 1; i < min(colors, 16); i++) {
+    if (distance(kBasicColors[i], rgb) < distance(kBasicColors[best], rgb)) {
+      best = i;
+    }
+  }
+  return best;
+}
+
+static int color_rgb(int color) {
+  return color & IMM_COLOR_RGB ? color & 0xffffff : palette_rgb(color);
+}
+
+// How far apart two colors look. The default color is unlike any other.
+static int color_distance(int a, int b) {
+  if (a == IMM_COLOR_DEFAULT || b == IMM_COLOR_DEFAULT) {
+    return a == b ? 0 : distance(0, 0xffffff) + 1;
+  }
+  return distance(color_rgb(a), color_rgb(b));
+}
+
+// Color number to give ncurses for `color`
+static int terminal_color(int color) {
+  if (color == IMM_COLOR_DEFAULT) {
+    return -1;
+  }
+  if (color & IMM_COLOR_RGB) {
+    return nearest_color(color & 0xffffff, COLORS);
+  }
+  return color < COLORS ? color : nearest_color(palette_rgb(color), COLORS);
+}
+
+void init_color_pairs() {
+  // Pairs beyond 255 don't fit in a chtype
+  capacity = COLOR_PAIRS > 1 ? min(COLOR_PAIRS - 1, 255) : 0;
+  pairs.clear();
+  uses.clear();
+}
+
+void begin_color_frame() { frame++; }
+
+// Pair whose colors look closest to `fg` and `bg`
+static short nearest_pair(int fg, int bg) {
+  short best = 0;
+  auto best_distance = color_distance(fg, IMM_COLOR_DEFAULT) +
+                       color_distance(bg, IMM_COLOR_DEFAULT);
+  for (auto& [key, entry] : pairs) {
+    auto d = color_distance(fg, (int)(uint32_t)(key >> 32)) +
+             color_distance(bg, (int)(uint32_t)key);
+    if (d < best_distance) {
+      best = entry.pair;
+      best_distance = d;
+    }
+  }
+  return best;
+}
+
+short color_pair(int fg, int bg) {
+  if (capacity == 0 ||
+      (fg == IMM_COLOR_DEFAULT && bg == IMM_COLOR_DEFAULT)) {
+    return 0;
+  }
+
+  auto key = (uint64_t)(uint32_t)fg << 32 | (uint32_t)bg;
+  auto it = pairs.find(key);
+  if (it != pairs.end()) {
+    uses.splice(uses.begin(), uses, it->second.use);
+    it->second.frame = frame;
+    return it->second.pair;
+  }
+
+  short pair;
+  if (pairs.size() < capacity) {
+    pair = pairs.size() + 1;
+  } else {
+    // Redefining a pair would recolor what's drawn with it. When even the
+    // least recently used one is on screen, they all are.
+    auto lru = pairs.find(uses.back());
+    if (lru->second.frame == frame) {
+      return nearest_pair(fg, bg);
+    }
+    pair = lru->second.pair;
+    pairs.erase(lru);
+    uses.pop_back();
+  }
+  init_pair(pair, terminal_color(fg), terminal_color(bg));
+  uses.push_front(key);
+  pairs[key] = pair_entry{pair, uses.begin(), frame};
+  return pair;
+}
@@ -0,0 +1,16 @@
+#ifndef COLORS_H
+#define COLORS_H
+
+// Color pairs for the foreground and background colors of glyphs, allocated
+// on demand. A color is a palette index, IMM_COLOR_DEFAULT or a direct color,
+// and colors the terminal lacks are mapped to the nearest ones it has. Once
+// the pairs run out, the least recently used one is redefined, unless it's
+// on screen in the current frame, in which case the nearest pair is used.
+void init_color_pairs();
+
+// Starts a frame that redraws the whole screen
+void begin_color_frame();
+
+short color_pair(int fg, int bg);
+
+#endif /* COLORS_H */
@@ -0,0 +1,410 @@
+#include "daemon.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include <algorithm>
+#include <cerrno>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+static const int kRefreshDelay = 500;  // ms
+static const int kRequestTimeout = 1;  // s
+static const int kClientTimeout = 2;   // s
+static const size_t kMaxFiles = 64;
+static const size_t kMemoryBudget = 64 * 1024 * 1024;
+
+#ifdef MSG_NOSIGNAL
+static const int kSendFlags = MSG_NOSIGNAL;
+#else
+static const int kSendFlags = 0;
+#endif
+
+static volatile sig_atomic_t stopped = 0;
+
+static void on_stop(int) { stopped = 1; }
+
+string daemon_socket_path() {
+  auto dir = getenv("XDG_RUNTIME_DIR");
+  if (dir && *dir) {
+    return string(dir) + "/immersion.sock";
+  }
+  return "/tmp/immersion-" + to_string(getuid()) + ".sock";
+}
+
+static bool socket_address(const string& path, sockaddr_un& addr) {
+  if (path.size() >= sizeof(addr.sun_path)) {
+    return false;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+  return true;
+}
+
+// Whether the other end of a connected socket runs as this user
+static bool same_user(int fd) {
+#ifdef SO_PEERCRED
+  ucred cred;
+  socklen_t len = sizeof(cred);
+  return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 &&
+         cred.uid == getuid();
+#else
+  uid_t uid;
+  gid_t gid;
+  return getpeereid(fd, &uid, &gid) == 0 && uid == getuid();
+#endif
+}
+
+// Connects to the daemon, unless the socket or the process behind it
+// belongs to someone else. Anyone can create a socket in /tmp, and would
+// learn the paths of the files opened.
+static int connect_daemon(const string& path) {
+  sockaddr_un addr;
+  struct stat st;
+  if (!socket_address(path, addr) || lstat(path.c_str(), &st) != 0 ||
+      !S_ISSOCK(st.st_mode) || st.st_uid != getuid() ||
+      (st.st_mode & 077) != 0) {
+    return -1;
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+#ifdef SO_NOSIGPIPE
+  int on = 1;
+  setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+  // A daemon busy with a huge file isn't waited for. The file is then
+  // opened and indexed as if there were no daemon.
+  timeval tv = {kClientTimeout, 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+      !same_user(fd)) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static bool send_all(int fd, const string& data) {
+  size_t sent = 0;
+  while (sent < data.size()) {
+    auto n = send(fd, data.data() + sent, data.size() - sent, kSendFlags);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    sent += n;
+  }
+  return true;
+}
+
+// Reads up to a newline, which isn't included
+static bool receive_line(int fd, string& line) {
+  line.clear();
+  char ch;
+  while (line.size() < PATH_MAX) {
+    auto n = recv(fd, &ch, 1, 0);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    if (ch == '\n') return true;
+    line += ch;
+  }
+  return false;
+}
+
+// A request is the absolute path of a file on a line, and the reply is "ok"
+// once its index is up to date, or "error".
+bool request_index(const string& path) {
+  char real[PATH_MAX];
+  if (!realpath(path.c_str(), real)) {
+    return false;
+  }
+  int fd = connect_daemon(daemon_socket_path());
+  if (fd < 0) {
+    return false;
+  }
+  string reply;
+  auto ok = send_all(fd, string(real) + "\n") && receive_line(fd, reply) &&
+            reply == "ok";
+  close(fd);
+  return ok;
+}
+
+index_daemon::~index_daemon() {
+  if (listen_fd_ >= 0) {
+    close(listen_fd_);
+    unlink(socket_path_.c_str());
+  }
+  if (inotify_fd_ >= 0) {
+    close(inotify_fd_);
+  }
+}
+
+// Binds the socket, unless another daemon is answering on it already
+bool index_daemon::listen() {
+  socket_path_ = daemon_socket_path();
+  sockaddr_un addr;
+  if (!socket_address(socket_path_, addr)) {
+    cerr << "socket path too long: " << socket_path_ << endl;
+    return false;
+  }
+  int running = connect_daemon(socket_path_);
+  if (running >= 0) {
+    close(running);
+    cerr << "already running on " << socket_path_ << endl;
+    return false;
+  }
+  unlink(socket_path_.c_str());
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return false;
+  }
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  auto mask = umask(077);
+  auto bound =
+      bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0;
+  umask(mask);
+  if (!bound || ::listen(fd, 16) != 0) {
+    cerr << "failed to listen on " << socket_path_ << endl;
+    close(fd);
+    return false;
+  }
+  listen_fd_ = fd;
+
+#ifdef __linux__
+  inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
+  return true;
+}
+
+// Serves clients until SIGINT or SIGTERM, then waits for the threads
+void index_daemon::run() {
+  struct sigaction sa = {};
+  sa.sa_handler = on_stop;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, nullptr);
+  sigaction(SIGTERM, &sa, nullptr);
+  signal(SIGPIPE, SIG_IGN);
+
+  while (!stopped) {
+    pollfd fds[] = {
+        {listen_fd_, POLLIN, 0},
+        {inotify_fd_, POLLIN, 0},
+    };
+    auto timeout = -1;
+    if (!stale_.empty()) {
+      auto ms = chrono::duration_cast<chrono::milliseconds>(
+                    refresh_at_ - chrono::steady_clock::now())
+                    .count();
+      timeout = (int)max<decltype(ms)>(ms + 1, 0);
+    }
+    if (poll(fds, 2, timeout) < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    if (!stale_.empty() && chrono::steady_clock::now() >= refresh_at_) {
+      auto stale = move(stale_);
+      stale_.clear();
+      for (auto& path : stale) {
+        spawn([this, path] { refresh(path); });
+      }
+    }
+    if (fds[1].revents & POLLIN) {
+      read_changes();
+    }
+    if (fds[0].revents & POLLIN) {
+      int client = accept(listen_fd_, nullptr, nullptr);
+      if (client >= 0) {
+        spawn([this, client] {
+          serve(client);
+          close(client);
+        });
+      }
+    }
+  }
+
+  unique_lock<mutex> lock(mutex_);
+  workers_done_.wait(lock, [this] { return workers_ == 0; });
+}
+
+void index_daemon::spawn(function<void()> fn) {
+  {
+    lock_guard<mutex> lock(mutex_);
+    workers_++;
+  }
+  thread([this, fn = move(fn)] {
+    fn();
+    lock_guard<mutex> lock(mutex_);
+    workers_--;
+    workers_done_.notify_all();
+  }).detach();
+}
+
+void index_daemon::serve(int client) {
+  if (!same_user(client)) {
+    return;
+  }
+  timeval tv = {kRequestTimeout, 0};
+  setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  string path;
+  if (!receive_line(client, path)) {
+    return;
+  }
+  auto ok = !path.empty() && path[0] == '/' && refresh(path);
+  if (ok) {
+    lock_guard<mutex> lock(mutex_);
+    auto it = files_.find(path);
+    if (it != files_.end()) {
+      it->second.last_used = ++uses_;
+    }
+    evict();
+  }
+  send_all(client, ok ? "ok\n" : "error\n");
+}
+
+// Indexes what changed in a file since it was last seen. The source is then
+// opened once more if needed, so what's kept is the mapped cache. Clients
+// asking for a file that's being indexed wait for it, while other files
+// are served meanwhile.
+bool index_daemon::refresh(const string& path) {
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+    lock_guard<mutex> lock(mutex_);
+    forget(path);
+    return false;
+  }
+  auto current = [&](const entry& e) {
+    return e.src && e.size == st.st_size && e.mtime == st.st_mtime;
+  };
+
+  shared_ptr<mutex> busy;
+  {
+    lock_guard<mutex> lock(mutex_);
+    auto& e = files_[path];
+    if (current(e)) {
+      return true;
+    }
+    busy = e.busy;
+  }
+  lock_guard<mutex> indexing(*busy);
+  {
+    lock_guard<mutex> lock(mutex_);
+    auto it = files_.find(path);
+    if (it != files_.end() && current(it->second)) {
+      return true;
+    }
+  }
+
+  auto src = make_shared<source>();
+  if (!src->open(path)) {
+    lock_guard<mutex> lock(mutex_);
+    forget(path);
+    return false;
+  }
+  if (!src->cached()) {
+    auto reopened = make_shared<source>();
+    if (reopened->open(path)) {
+      src = reopened;
+    }
+  }
+
+  lock_guard<mutex> lock(mutex_);
+  auto& e = files_[path];
+  e.src = src;
+  e.size = st.st_size;
+  e.mtime = st.st_mtime;
+#ifdef __linux__
+  if (e.watch < 0 && inotify_fd_ >= 0) {
+    e.watch = inotify_add_watch(inotify_fd_, path.c_str(),
+                                IN_MODIFY | IN_DELETE_SELF | IN_MOVE_SELF);
+    if (e.watch >= 0) {
+      watches_[e.watch] = path;
+    }
+  }
+#endif
+  return true;
+}
+
+// Drops the files requested least recently while there are more than
+// kMaxFiles, or what they hold in memory exceeds kMemoryBudget. Files still
+// being indexed, and the one used last, stay. The lock is held by the
+// caller.
+void index_daemon::evict() {
+  vector<pair<size_t, string>> files;
+  size_t total = 0;
+  for (auto& [path, e] : files_) {
+    if (e.src) {
+      files.emplace_back(e.last_used, path);
+      total += e.src->memory_usage();
+    }
+  }
+  sort(files.begin(), files.end());
+  auto count = files.size();
+  for (size_t i = 0; i + 1 < files.size(); i++) {
+    if (count <= kMaxFiles && total <= kMemoryBudget) break;
+    total -= files_[files[i].second].src->memory_usage();
+    count--;
+    forget(files[i].second);
+  }
+}
+
+// Drops a file. The lock is held by the caller.
+void index_daemon::forget(const string& path) {
+  auto it = files_.find(path);
+  if (it == files_.end()) {
+    return;
+  }
+#ifdef __linux__
+  if (it->second.watch >= 0) {
+    inotify_rm_watch(inotify_fd_, it->second.watch);
+    watches_.erase(it->second.watch);
+  }
+#endif
+  files_.erase(it);
+}
+
+// Files that were written to are indexed again a little later, so a file
+// that keeps growing isn't indexed on every write. Ones that were removed or
+// renamed are dropped.
+void index_daemon::read_changes() {
+#ifdef __linux__
+  alignas(inotify_event) char buf[4096];
+  ssize_t len;
+  lock_guard<mutex> lock(mutex_);
+  while ((len = read(inotify_fd_, buf, sizeof(buf))) > 0) {
+    for (ssize_t i = 0; i < len;) {
+      auto ev = reinterpret_cast<const inotify_event*>(buf + i);
+      i += sizeof(inotify_event) + ev->len;
+      auto it = watches_.find(ev->wd);
+      if (it == watches_.end()) continue;
+      auto path = it->second;
+      if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+        stale_.erase(path);
+        forget(path);
+      } else if (ev->mask & IN_MODIFY) {
+        if (stale_.empty()) {
+          refresh_at_ = chrono::steady_clock::now() +
+                        chrono::milliseconds(kRefreshDelay);
+        }
+        stale_.insert(path);
+      }
+    }
+  }
+#endif
+}
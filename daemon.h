@@ -0,0 +1,73 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+
+#include "source.h"
+
+// Socket the index daemon listens on, in $XDG_RUNTIME_DIR or /tmp. Only a
+// socket of this user's, and a daemon running as this user, are trusted.
+std::string daemon_socket_path();
+
+// Asks the index daemon to bring the cached index of `path` up to date, so
+// that opening the file only has to map it. Returns false when no daemon is
+// running, it couldn't index the file, or it didn't answer in time.
+bool request_index(const std::string& path);
+
+// Keeps the indexes of the files clients open up to date in the cache, and
+// keeps the caches mapped, so every client maps the same pages rather than
+// indexing a copy of its own. Files that grow are indexed again shortly
+// after, without waiting for the next client. Each client is served on a
+// thread of its own, and only one thread indexes a file at a time. The
+// files requested least recently are dropped beyond a count and a memory
+// budget.
+class index_daemon {
+ public:
+  index_daemon() = default;
+  index_daemon(const index_daemon&) = delete;
+  index_daemon& operator=(const index_daemon&) = delete;
+  ~index_daemon();
+
+  bool listen();
+  void run();
+
+ private:
+  struct entry {
+    std::shared_ptr<std::mutex> busy = std::make_shared<std::mutex>();
+    std::shared_ptr<source> src;  // null until first indexed
+    off_t size = 0;
+    time_t mtime = 0;
+    int watch = -1;
+    size_t last_used = 0;
+  };
+
+  void spawn(std::function<void()> fn);
+  void serve(int client);
+  bool refresh(const std::string& path);
+  void forget(const std::string& path);
+  void evict();
+  void read_changes();
+
+  int listen_fd_ = -1;
+  int inotify_fd_ = -1;
+  std::string socket_path_;
+
+  // Guards the files, their watches and the count of threads
+  std::mutex mutex_;
+  std::condition_variable workers_done_;
+  size_t workers_ = 0;
+  std::map<std::string, entry> files_;
+  size_t uses_ = 0;
+  std::map<int, std::string> watches_;
+  std::set<std::string> stale_;  // changed, to be indexed again
+  std::chrono::steady_clock::time_point refresh_at_;
+};
+
+#endif /* DAEMON_H */
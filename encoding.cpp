@@ -0,0 +1,481 @@
+#include "encoding.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+using namespace std;
+
+static const size_t kDetectBytes = 64 * 1024;
+static const int kDetectTimeout = 100;  // ms
+// UTF-8 is given up only when more than 1 in kUtf8ErrorRatio of its
+// non-ASCII sequences are invalid, and then only for an encoding that has at
+// least kLegacyMargin fewer errors and no more than 1 in kLegacyErrorRatio
+// of UTF-8's.
+static const size_t kUtf8ErrorRatio = 4;
+static const size_t kLegacyMargin = 2;
+static const size_t kLegacyErrorRatio = 4;
+static const char kReplacement[] = "\xef\xbf\xbd";  // U+FFFD
+
+static unsigned char byte_at(const char* p, size_t i) {
+  return static_cast<unsigned char>(p[i]);
+}
+
+size_t ascii_end(const char* data, size_t pos, size_t size) {
+  while (pos + 8 <= size) {
+    uint64_t word;
+    memcpy(&word, data + pos, 8);
+    if (word & 0x8080808080808080ULL) break;
+    pos += 8;
+  }
+  while (pos < size && byte_at(data, pos) < 0x80) {
+    pos++;
+  }
+  return pos;
+}
+
+// Invalid sequences in `data` as UTF-8, not counting a character cut off at
+// the end. `chars` is set to the number of valid non-ASCII characters.
+static size_t utf8_errors(const char* data, size_t size, size_t& chars) {
+  size_t errors = 0;
+  chars = 0;
+  size_t pos = 0;
+  while ((pos = ascii_end(data, pos, size)) < size) {
+    auto b = byte_at(data, pos);
+    size_t len = 0xc2 <= b && b <= 0xdf   ? 2
+                 : 0xe0 <= b && b <= 0xef ? 3
+                 : 0xf0 <= b && b <= 0xf4 ? 4
+                                          : 0;
+    if (len == 0) {
+      errors++;
+      pos++;
+      continue;
+    }
+    size_t i = 1;
+    while (i < len && pos + i < size &&
+           (byte_at(data, pos + i) & 0xc0) == 0x80) {
+      i++;
+    }
+    if (i < len && pos + i < size) {
+      errors++;
+    } else {
+      chars++;
+    }
+    pos += i;
+  }
+  return errors;
+}
+
+// Whether `data` reads as UTF-16 in the given byte order: it has newlines,
+// each a whole code unit at an even offset, no NULs, and its surrogates come
+// in pairs. Text in the other encodings has no zero byte next to a newline.
+static bool is_utf16(const char* data, size_t size, bool little_endian) {
+  auto unit = [&](size_t i) {
+    auto lo = byte_at(data, little_endian ? i : i + 1);
+    auto hi = byte_at(data, little_endian ? i + 1 : i);
+    return static_cast<uint16_t>(hi << 8 | lo);
+  };
+  size_t newlines = 0;
+  for (size_t i = 0; i + 1 < size; i += 2) {
+    auto u = unit(i);
+    if (u == 0 || (0xdc00 <= u && u <= 0xdfff)) {
+      return false;
+    }
+    if (u == '\n') {
+      newlines++;
+    } else if (0xd800 <= u && u <= 0xdbff && i + 3 < size) {
+      auto low = unit(i + 2);
+      if (low < 0xdc00 || 0xdfff < low) {
+        return false;
+      }
+      i += 2;
+    }
+  }
+  return newlines > 0;
+}
+
+static bool is_sjis_lead(unsigned char b) {
+  return (0x81 <= b && b <= 0x9f) || (0xe0 <= b && b <= 0xfc);
+}
+
+static bool is_sjis_trail(unsigned char b) {
+  return (0x40 <= b && b <= 0x7e) || (0x80 <= b && b <= 0xfc);
+}
+
+static bool is_euc_byte(unsigned char b) { return 0xa1 <= b && b <= 0xfe; }
+
+// Invalid sequences in `data` as Shift_JIS or EUC-JP
+static size_t legacy_errors(encoding enc, const char* data, size_t size) {
+  size_t errors = 0;
+  size_t pos = 0;
+  while ((pos = ascii_end(data, pos, size)) < size) {
+    auto b = byte_at(data, pos);
+    // A character cut off at the end counts as valid
+    auto cut = pos + 1 == size;
+    auto b2 = cut ? 0 : byte_at(data, pos + 1);
+    size_t len = 0;
+    if (enc == encoding::shift_jis) {
+      if (0xa1 <= b && b <= 0xdf) {
+        len = 1;
+      } else if (is_sjis_lead(b) && (cut || is_sjis_trail(b2))) {
+        len = 2;
+      }
+    } else {
+      if (b == 0x8e && (cut || (0xa1 <= b2 && b2 <= 0xdf))) {
+        len = 2;
+      } else if (b == 0x8f && (cut || is_euc_byte(b2))) {
+        len = 3;
+      } else if (is_euc_byte(b) && (cut || is_euc_byte(b2))) {
+        len = 2;
+      }
+    }
+    if (len == 0) {
+      errors++;
+      len = 1;
+    }
+    pos += len;
+  }
+  return errors;
+}
+
+encoding detect_encoding(const char* data, size_t size, size_t& bom_len) {
+  bom_len = 0;
+  if (size >= 3 && byte_at(data, 0) == 0xef && byte_at(data, 1) == 0xbb &&
+      byte_at(data, 2) == 0xbf) {
+    bom_len = 3;
+    return encoding::utf8;
+  }
+  if (size >= 2 && byte_at(data, 0) == 0xff && byte_at(data, 1) == 0xfe) {
+    bom_len = 2;
+    return encoding::utf16le;
+  }
+  if (size >= 2 && byte_at(data, 0) == 0xfe && byte_at(data, 1) == 0xff) {
+    bom_len = 2;
+    return encoding::utf16be;
+  }
+
+  size = min(size, kDetectBytes);
+
+  // UTF-16 without a mark has a zero in every other byte of Latin text,
+  // while text in the other encodings has hardly any zeros
+  size_t zeros[2] = {0, 0};
+  for (size_t i = 0; i < size; i++) {
+    if (data[i] == 0) zeros[i % 2]++;
+  }
+  auto units = size / 2;
+  if (units >= 2 && zeros[1] > units / 4 && zeros[0] < zeros[1] / 8) {
+    return encoding::utf16le;
+  }
+  if (units >= 2 && zeros[0] > units / 4 && zeros[1] < zeros[0] / 8) {
+    return encoding::utf16be;
+  }
+  // Text in other scripts has few zeros, but its newlines still give it away
+  if (zeros[0] + zeros[1] > 0) {
+    if (is_utf16(data, size, true)) return encoding::utf16le;
+    if (is_utf16(data, size, false)) return encoding::utf16be;
+  }
+
+  // A few stray bytes in UTF-8 text, such as Latin-1 pasted in, often
+  // happen to be valid Shift_JIS, so UTF-8 stays unless it mostly fails and
+  // another encoding does clearly better. Of those, the one with the fewest
+  // invalid sequences wins. EUC-JP text tends to be valid Shift_JIS as
+  // well, but not the other way around, so EUC-JP is preferred on a tie.
+  size_t utf8_chars;
+  auto utf8 = utf8_errors(data, size, utf8_chars);
+  if (utf8 * kUtf8ErrorRatio <= utf8 + utf8_chars) {
+    return encoding::utf8;
+  }
+  auto best = encoding::utf8;
+  auto best_errors = utf8;
+  for (auto enc : {encoding::euc_jp, encoding::shift_jis}) {
+    auto errors = legacy_errors(enc, data, size);
+    if (errors + kLegacyMargin <= utf8 &&
+        errors * kLegacyErrorRatio <= utf8 && errors < best_errors) {
+      best = enc;
+      best_errors = errors;
+    }
+  }
+  return best;
+}
+
+static void append_utf8(uint32_t cp, vector<char>& out) {
+  if (cp < 0x80) {
+    out.push_back(cp);
+  } else if (cp < 0x800) {
+    out.push_back(0xc0 | cp >> 6);
+    out.push_back(0x80 | (cp & 0x3f));
+  } else if (cp < 0x10000) {
+    out.push_back(0xe0 | cp >> 12);
+    out.push_back(0x80 | (cp >> 6 & 0x3f));
+    out.push_back(0x80 | (cp & 0x3f));
+  } else {
+    out.push_back(0xf0 | cp >> 18);
+    out.push_back(0x80 | (cp >> 12 & 0x3f));
+    out.push_back(0x80 | (cp >> 6 & 0x3f));
+    out.push_back(0x80 | (cp & 0x3f));
+  }
+}
+
+transcoder::transcoder(encoding enc) : enc_(enc) {
+  if (enc_ == encoding::shift_jis) {
+    // Windows' superset, which most Shift_JIS files really are
+    cd_ = iconv_open("UTF-8", "CP932");
+  } else if (enc_ == encoding::euc_jp) {
+    cd_ = iconv_open("UTF-8", "EUC-JP");
+  }
+}
+
+transcoder::~transcoder() {
+  if (cd_ != (iconv_t)-1) {
+    iconv_close(cd_);
+  }
+}
+
+void transcoder::convert(const char* data, size_t size, bool last,
+                         vector<char>& out) {
+  if (!pending_.empty()) {
+    while (size > 0 &&
+           pending_.size() < char_len(pending_.data(), pending_.size())) {
+      pending_ += *data++;
+      size--;
+    }
+    if (pending_.size() >= char_len(pending_.data(), pending_.size())) {
+      convert_chars(pending_.data(), pending_.size(), out);
+      pending_.clear();
+    }
+  }
+
+  auto done = convert_chars(data, size, out);
+  pending_.append(data + done, size - done);
+  if (last && !pending_.empty()) {
+    out.insert(out.end(), kReplacement, kReplacement + 3);
+    pending_.clear();
+  }
+}
+
+// Length of the character at `p`, which may be more than `size`
+size_t transcoder::char_len(const char* p, size_t size) const {
+  auto b = byte_at(p, 0);
+  switch (enc_) {
+    case encoding::shift_jis:
+      return is_sjis_lead(b) ? 2 : 1;
+    case encoding::euc_jp:
+      return b == 0x8f ? 3 : b == 0x8e || is_euc_byte(b) ? 2 : 1;
+    case encoding::utf16le:
+    case encoding::utf16be: {
+      if (size < 2) return 2;
+      auto hi = enc_ == encoding::utf16le ? byte_at(p, 1) : b;
+      return 0xd8 <= hi && hi <= 0xdb ? 4 : 2;
+    }
+    default:
+      return 1;
+  }
+}
+
+// Converts the whole characters in `data` and returns how many bytes they
+// take
+size_t transcoder::convert_chars(const char* data, size_t size,
+                                 vector<char>& out) {
+  if (enc_ == encoding::utf16le || enc_ == encoding::utf16be) {
+    return convert_utf16(data, size, out);
+  }
+  return convert_legacy(data, size, out);
+}
+
+size_t transcoder::convert_legacy(const char* data, size_t size,
+                                  vector<char>& out) {
+  size_t pos = 0;
+  while (pos < size) {
+    auto end = ascii_end(data, pos, size);
+    out.insert(out.end(), data + pos, data + end);
+    pos = end;
+
+    // A trail byte of Shift_JIS can be ASCII, so the run of other characters
+    // ends at the first ASCII byte that starts a character.
+    auto run = pos;
+    while (pos < size && byte_at(data, pos) >= 0x80) {
+      auto len = char_len(data + pos, size - pos);
+      if (pos + len > size) break;
+      pos += len;
+    }
+    if (cd_ == (iconv_t)-1) {
+      out.insert(out.end(), data + run, data + pos);
+    } else {
+      auto in = const_cast<char*>(data + run);
+      auto in_left = pos - run;
+      while (in_left > 0) {
+        auto used = out.size();
+        out.resize(used + in_left * 3 + 16);
+        auto out_ptr = out.data() + used;
+        auto out_left = out.size() - used;
+        auto r = iconv(cd_, &in, &in_left, &out_ptr, &out_left);
+        out.resize(out_ptr - out.data());
+        if (r == (size_t)-1 && errno != E2BIG) {
+          out.insert(out.end(), kReplacement, kReplacement + 3);
+          in++;
+          in_left--;
+        }
+      }
+    }
+    if (pos < size && byte_at(data, pos) >= 0x80) {
+      break;  // cut off at the end
+    }
+  }
+  return pos;
+}
+
+size_t transcoder::convert_utf16(const char* data, size_t size,
+                                 vector<char>& out) {
+  auto le = enc_ == encoding::utf16le;
+  auto unit = [&](size_t i) -> uint32_t {
+    return le ? byte_at(data, i) | byte_at(data, i + 1) << 8
+              : byte_at(data, i) << 8 | byte_at(data, i + 1);
+  };
+  size_t pos = 0;
+  while (pos + 2 <= size) {
+    auto u = unit(pos);
+    if (u < 0x80) {
+      out.push_back(u);
+      pos += 2;
+      continue;
+    }
+    size_t len = 2;
+    uint32_t cp = u;
+    if (0xd800 <= u && u < 0xdc00) {
+      if (pos + 4 > size) break;
+      auto u2 = unit(pos + 2);
+      if (0xdc00 <= u2 && u2 < 0xe000) {
+        cp = 0x10000 + ((u - 0xd800) << 10) + (u2 - 0xdc00);
+        len = 4;
+      } else {
+        cp = 0xfffd;
+      }
+    } else if (0xdc00 <= u && u < 0xe000) {
+      cp = 0xfffd;
+    }
+    append_utf8(cp, out);
+    pos += len;
+  }
+  return pos;
+}
+
+void decoder::detect() {
+  detected_ = true;
+  size_t bom_len;
+  auto enc = detect_encoding(raw_.data(), raw_.size(), bom_len);
+  if (enc == encoding::utf8) {
+    decoded_.assign(raw_.begin() + bom_len, raw_.end());
+  } else {
+    transcoder_ = make_unique<transcoder>(enc);
+    transcoder_->convert(raw_.data() + bom_len, raw_.size() - bom_len, eof_,
+                         decoded_);
+  }
+  raw_.resize(kDetectBytes);
+}
+
+// Whether `fd` has input within `timeout` milliseconds
+static bool readable(int fd, int timeout) {
+  pollfd p = {fd, POLLIN, 0};
+  int n;
+  while ((n = poll(&p, 1, timeout)) < 0 && errno == EINTR) {
+  }
+  return n != 0;
+}
+
+// Length of the UTF-8 at the start of `data` that can be passed on as it
+// is, leaving out a character cut off at the end. `invalid` is set if there
+// is a NUL or an invalid sequence, which makes all of it suspect.
+static size_t utf8_prefix(const char* data, size_t size, bool& invalid) {
+  invalid = memchr(data, 0, size) != nullptr;
+  size_t pos = 0;
+  while (!invalid && (pos = ascii_end(data, pos, size)) < size) {
+    auto b = byte_at(data, pos);
+    size_t len = 0xc2 <= b && b <= 0xdf   ? 2
+                 : 0xe0 <= b && b <= 0xef ? 3
+                 : 0xf0 <= b && b <= 0xf4 ? 4
+                                          : 0;
+    size_t i = 1;
+    while (i < len && pos + i < size &&
+           (byte_at(data, pos + i) & 0xc0) == 0x80) {
+      i++;
+    }
+    if (i < len && pos + i == size) {
+      break;
+    }
+    invalid = i < len || len == 0;
+    pos += i;
+  }
+  return pos;
+}
+
+// Until the encoding is known, text that is valid UTF-8 is passed on as it
+// arrives. The encoding is detected once kDetectBytes have been, or from the
+// first block that isn't, as soon as there are kDetectBytes of it or the
+// input pauses for kDetectTimeout or ends.
+ssize_t decoder::read(char* buf, size_t size) {
+  while (!detected_) {
+    bool invalid;
+    auto valid = utf8_prefix(raw_.data(), raw_.size(), invalid);
+    if (passed_ == 0 && raw_.size() >= 3 &&
+        memcmp(raw_.data(), "\xef\xbb\xbf", 3) == 0) {
+      detect();  // drops the byte order mark
+      break;
+    }
+    if (!invalid && valid > 0) {
+      auto n = min(size, valid);
+      memcpy(buf, raw_.data(), n);
+      raw_.erase(raw_.begin(), raw_.begin() + n);
+      passed_ += n;
+      if (passed_ >= kDetectBytes) {
+        detect();
+      }
+      return n;
+    }
+    if (raw_.empty() && eof_) {
+      return 0;
+    }
+    if (eof_ || raw_.size() >= kDetectBytes || (invalid && paused_)) {
+      detect();
+      break;
+    }
+    if (invalid && !readable(fd_, kDetectTimeout)) {
+      paused_ = true;
+      continue;
+    }
+    auto len = raw_.size();
+    raw_.resize(kDetectBytes);
+    auto n = ::read(fd_, raw_.data() + len, raw_.size() - len);
+    raw_.resize(len + max<ssize_t>(n, 0));
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) return -1;
+    eof_ = n == 0;
+    paused_ = false;
+  }
+
+  while (decoded_pos_ == decoded_.size()) {
+    decoded_.clear();
+    decoded_pos_ = 0;
+    if (eof_) {
+      return 0;
+    }
+    if (!transcoder_) {
+      return ::read(fd_, buf, size);
+    }
+    auto n = ::read(fd_, raw_.data(), raw_.size());
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) {
+      return -1;
+    }
+    eof_ = n == 0;
+    transcoder_->convert(raw_.data(), n, eof_, decoded_);
+  }
+
+  auto n = min(size, decoded_.size() - decoded_pos_);
+  memcpy(buf, decoded_.data() + decoded_pos_, n);
+  decoded_pos_ += n;
+  return n;
+}
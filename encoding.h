@@ -0,0 +1,71 @@
+#ifndef ENCODING_H
+#define ENCODING_H
+
+#include <iconv.h>
+#include <sys/types.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+enum class encoding { utf8, utf16le, utf16be, shift_jis, euc_jp };
+
+// End of the run of ASCII in `data` from `pos`, checked a word at a time
+size_t ascii_end(const char* data, size_t pos, size_t size);
+
+// Guesses the encoding of text from its byte order mark, or from how well
+// its first block decodes. `bom_len` is set to the length of the mark.
+encoding detect_encoding(const char* data, size_t size, size_t& bom_len);
+
+// Converts text to UTF-8 a block at a time. In Shift_JIS and EUC-JP, runs of
+// ASCII are found eight bytes at a time and copied as they are, and only the
+// characters in between go through iconv.
+class transcoder {
+ public:
+  explicit transcoder(encoding enc);
+  transcoder(const transcoder&) = delete;
+  transcoder& operator=(const transcoder&) = delete;
+  ~transcoder();
+
+  // Appends `data` in UTF-8 to `out`. A character cut off at the end is
+  // completed by the next call, or replaced with U+FFFD when `last` is set.
+  void convert(const char* data, size_t size, bool last,
+               std::vector<char>& out);
+
+ private:
+  size_t char_len(const char* p, size_t size) const;
+  size_t convert_chars(const char* data, size_t size, std::vector<char>& out);
+  size_t convert_legacy(const char* data, size_t size,
+                        std::vector<char>& out);
+  size_t convert_utf16(const char* data, size_t size, std::vector<char>& out);
+
+  encoding enc_;
+  iconv_t cd_ = (iconv_t)-1;
+  std::string pending_;
+};
+
+// Reads text from a file descriptor as UTF-8, detecting its encoding from
+// the first block. Valid UTF-8 is passed on as it arrives meanwhile, so a
+// stream that is still being written to isn't held up.
+class decoder {
+ public:
+  explicit decoder(int fd) : fd_(fd) {}
+
+  // Reads up to `size` bytes. Returns 0 at the end and -1 on errors.
+  ssize_t read(char* buf, size_t size);
+
+ private:
+  void detect();
+
+  int fd_;
+  bool detected_ = false;
+  bool eof_ = false;
+  bool paused_ = false;
+  size_t passed_ = 0;
+  std::vector<char> raw_;
+  std::vector<char> decoded_;
+  size_t decoded_pos_ = 0;
+  std::unique_ptr<transcoder> transcoder_;
+};
+
+#endif /* ENCODING_H */
@@ -0,0 +1,55 @@
+#include "immersion.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "layout.h"
+
+using namespace std;
+
+// Calls `fn` with each '\n' terminated line of the buffer and its offset.
+template <typename Fn>
+static void each_line(const char* buf, size_t len, Fn fn) {
+  size_t pos = 0;
+  while (pos < len) {
+    auto end = static_cast<const char*>(memchr(buf + pos, '\n', len - pos));
+    auto line_len = end ? end - (buf + pos) : len - pos;
+    fn(string_view(buf + pos, line_len), pos);
+    pos += line_len + 1;
+  }
+}
+
+size_t imm_columns(const char* buf, size_t len) {
+  return columns(string_view(buf, len));
+}
+
+size_t imm_max_columns(const char* buf, size_t len) {
+  size_t cols = 0;
+  each_line(buf, len,
+            [&](string_view line, size_t) { cols = max(cols, columns(line)); });
+  return cols;
+}
+
+size_t imm_fold_lines(const char* buf, size_t len, size_t cols, int word_wrap,
+                      imm_span* spans, size_t max_spans) {
+  size_t count = 0;
+  size_t line_no = 0;
+  each_line(buf, len, [&](string_view line, size_t offset) {
+    for (auto span : fold_line(line, cols, word_wrap)) {
+      if (count < max_spans) {
+        spans[count] = imm_span{offset + span.offset, span.length, line_no};
+      }
+      count++;
+    }
+    line_no++;
+  });
+  return count;
+}
+
+size_t imm_attributes(const char* buf, size_t len, imm_glyph* glyphs,
+                      size_t max_glyphs) {
+  auto result = attribute_line(string_view(buf, len));
+  copy_n(result.begin(), min(result.size(), max_glyphs), glyphs);
+  return result.size();
+}
@@ -0,0 +1,69 @@
+#ifndef IMMERSION_H
+#define IMMERSION_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A display line: `length` bytes at `offset` in the buffer, folded from
+ * source line number `line`.
+ */
+typedef struct {
+  size_t offset;
+  size_t length;
+  size_t line;
+} imm_span;
+
+#define IMM_ATTR_BOLD 0x1
+#define IMM_ATTR_UNDERLINE 0x2
+#define IMM_ATTR_DIM 0x4
+#define IMM_ATTR_ITALIC 0x8
+#define IMM_ATTR_BLINK 0x10
+#define IMM_ATTR_REVERSE 0x20
+#define IMM_ATTR_INVISIBLE 0x40
+#define IMM_ATTR_STRIKE 0x80
+
+#define IMM_COLOR_DEFAULT -1
+#define IMM_COLOR_RGB 0x1000000
+
+/* A visible character: `length` bytes at `offset`, drawn with `attrs` and
+ * the colors `fg` and `bg`. A color is an index into the 256 color palette,
+ * IMM_COLOR_DEFAULT, or IMM_COLOR_RGB | 0xRRGGBB for a direct color.
+ */
+typedef struct {
+  size_t offset;
+  size_t length;
+  unsigned int attrs;
+  int fg;
+  int bg;
+} imm_glyph;
+
+/* Display width of a line, skipping escape sequences and overstrikes.
+ */
+size_t imm_columns(const char* buf, size_t len);
+
+/* Widest line of a buffer of '\n' terminated lines.
+ */
+size_t imm_max_columns(const char* buf, size_t len);
+
+/* Fold a buffer of '\n' terminated lines into display lines of at most
+ * `cols` columns. Up to `max_spans` spans are stored in `spans`, and the
+ * total number of display lines is returned, so a return value larger than
+ * `max_spans` means the call should be retried with a bigger array.
+ */
+size_t imm_fold_lines(const char* buf, size_t len, size_t cols, int word_wrap,
+                      imm_span* spans, size_t max_spans);
+
+/* Split a display line into glyphs with their attributes. Returns the
+ * number of glyphs the same way as imm_fold_lines.
+ */
+size_t imm_attributes(const char* buf, size_t len, imm_glyph* glyphs,
+                      size_t max_glyphs);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* IMMERSION_H */
@@ -1,5 +1,7 @@
 #!/usr/bin/env python3
 import argparse
+import ctypes
+import ctypes.util
 import curses
 import locale
 import os
@@ -7,6 +9,107 @@ import signal
 import sys
 import unicodedata
 
+#------------------------------------------------------------------------------
+# libimmersion (optional, see `make lib`)
+
+class ImmSpan(ctypes.Structure):
+    _fields_ = [('offset', ctypes.c_size_t),
+                ('length', ctypes.c_size_t),
+                ('line', ctypes.c_size_t)]
+
+class ImmGlyph(ctypes.Structure):
+    _fields_ = [('offset', ctypes.c_size_t),
+                ('length', ctypes.c_size_t),
+                ('attrs', ctypes.c_uint),
+                ('fg', ctypes.c_int),
+                ('bg', ctypes.c_int)]
+
+IMM_ATTR_BOLD = 0x1
+IMM_ATTR_UNDERLINE = 0x2
+IMM_ATTR_DIM = 0x4
+IMM_ATTR_ITALIC = 0x8
+IMM_ATTR_BLINK = 0x10
+IMM_ATTR_REVERSE = 0x20
+IMM_ATTR_INVISIBLE = 0x40
+
+def load_library():
+    here = os.path.dirname(os.path.abspath(__file__))
+    paths = [os.path.join(here, name) for name in ['libimmersion.so', 'libimmersion.dylib']]
+    found = ctypes.util.find_library('immersion')
+    if found:
+        paths.append(found)
+    for path in paths:
+        try:
+            lib = ctypes.CDLL(path)
+        except OSError:
+            continue
+        lib.imm_max_columns.restype = ctypes.c_size_t
+        lib.imm_max_columns.argtypes = [ctypes.c_char_p, ctypes.c_size_t]
+        lib.imm_fold_lines.restype = ctypes.c_size_t
+        lib.imm_fold_lines.argtypes = [ctypes.c_char_p, ctypes.c_size_t, ctypes.c_size_t, ctypes.c_int,
+                                       ctypes.POINTER(ImmSpan), ctypes.c_size_t]
+        lib.imm_attributes.restype = ctypes.c_size_t
+        lib.imm_attributes.argtypes = [ctypes.c_char_p, ctypes.c_size_t,
+                                       ctypes.POINTER(ImmGlyph), ctypes.c_size_t]
+        return lib
+    return None
+
+lib = load_library()
+
+def to_buffer(lines):
+    return ''.join(line.rstrip('\n') + '\n' for line in lines).encode('utf-8')
+
+def lib_max_colums(lines):
+    buf = to_buffer(lines)
+    return lib.imm_max_columns(buf, len(buf))
+
+def lib_attributed_line(row):
+    glyphs = (ImmGlyph * len(row))()
+    count = lib.imm_attributes(row, len(row), glyphs, len(row))
+    result = []
+    for glyph in glyphs[:count]:
+        att = curses.A_NORMAL
+        if glyph.attrs & IMM_ATTR_BOLD:
+            att |= curses.A_BOLD
+        if glyph.attrs & IMM_ATTR_UNDERLINE:
+            att |= curses.A_UNDERLINE
+        if glyph.attrs & IMM_ATTR_DIM:
+            att |= curses.A_DIM
+        if glyph.attrs & IMM_ATTR_ITALIC and hasattr(curses, 'A_ITALIC'):
+            att |= curses.A_ITALIC
+        if glyph.attrs & IMM_ATTR_BLINK:
+            att |= curses.A_BLINK
+        if glyph.attrs & IMM_ATTR_REVERSE:
+            att |= curses.A_REVERSE
+        if glyph.attrs & IMM_ATTR_INVISIBLE:
+            att |= curses.A_INVIS
+        c = row[glyph.offset:glyph.offset + glyph.length].decode('utf-8', 'replace')
+        if result and result[-1][1] == att:
+            result[-1] = (result[-1][0] + c, att)
+        else:
+            result.append((c, att))
+    return result
+
+def lib_fold_lines(lines, cols, linespace, word_warp):
+    buf = to_buffer(lines)
+    capacity = len(buf) // max(cols, 1) + len(lines) + 1
+    while True:
+        spans = (ImmSpan * capacity)()
+        count = lib.imm_fold_lines(buf, len(buf), cols, word_warp, spans, capacity)
+        if count <= capacity:
+            break
+        capacity = count
+    out = []
+    prev = None
+    for span in spans[:count]:
+        if linespace and prev is not None and prev != span.line:
+            out.append([])
+        prev = span.line
+        out.append(lib_attributed_line(buf[span.offset:span.offset + span.length]))
+    return out
+
+#------------------------------------------------------------------------------
+
 def columns(line):
     cols = 0;
     for c in list(line):
@@ -18,6 +121,8 @@ def columns(line):
     return cols
 
 def max_colums(lines):
+    if lib:
+        return lib_max_colums(lines)
     cols = 0
     for line in lines:
         cols = max(cols, columns(line))
@@ -128,6 +233,8 @@ def to_attributed_line(line):
     return result
 
 def fold_lines(lines, cols, linespace, word_warp):
+    if lib:
+        return lib_fold_lines(lines, cols, linespace, word_warp)
     filtered = [line for line in lines if linespace == False or len(lines) > 0]
     out = []
     init = True
@@ -0,0 +1,445 @@
+#include "layout.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "utf8.h"
+
+using namespace std;
+
+static const size_t kColumnStep = 256;
+
+// Color of an extended color parameter: "5;n" for a palette index or
+// "2;r;g;b" for a direct color, taken from `args`. Returns false when the
+// parameter is malformed.
+static bool extended_color(const vector<int>& args, int& color) {
+  if (args.size() >= 2 && args[0] == 5) {
+    color = min(max(args[1], 0), 255);
+    return true;
+  }
+  if (args.size() >= 4 && args[0] == 2) {
+    auto c = [&](size_t i) { return min(max(args[i], 0), 255); };
+    // "2:id:r:g:b" carries a color space id in front when colons are used
+    auto i = args.size() >= 5 ? 2 : 1;
+    color = IMM_COLOR_RGB | c(i) << 16 | c(i + 1) << 8 | c(i + 2);
+    return true;
+  }
+  return false;
+}
+
+// Applies the parameters of an SGR sequence such as "1;38;5;208" to `st`.
+// Empty parameters count as 0, and sub-parameters may be separated with
+// colons as in "38:2::255:128:0".
+static void apply_sgr(string_view params, style& st) {
+  vector<vector<int>> groups(1, vector<int>(1, 0));
+  for (auto c : params) {
+    if (c == ';') {
+      groups.emplace_back(1, 0);
+    } else if (c == ':') {
+      groups.back().push_back(0);
+    } else if ('0' <= c && c <= '9') {
+      auto& val = groups.back().back();
+      val = min(val * 10 + (c - '0'), 0xffffff);
+    }
+  }
+
+  for (size_t i = 0; i < groups.size(); i++) {
+    auto& group = groups[i];
+    auto val = group[0];
+    switch (val) {
+      case 0:
+        st = style();
+        break;
+      case 1:
+        st.attrs |= IMM_ATTR_BOLD;
+        break;
+      case 2:
+        st.attrs |= IMM_ATTR_DIM;
+        break;
+      case 3:
+        st.attrs |= IMM_ATTR_ITALIC;
+        break;
+      case 4:
+        st.attrs |= IMM_ATTR_UNDERLINE;
+        break;
+      case 5:
+      case 6:
+        st.attrs |= IMM_ATTR_BLINK;
+        break;
+      case 7:
+        st.attrs |= IMM_ATTR_REVERSE;
+        break;
+      case 8:
+        st.attrs |= IMM_ATTR_INVISIBLE;
+        break;
+      case 9:
+        st.attrs |= IMM_ATTR_STRIKE;
+        break;
+      case 21:
+        st.attrs |= IMM_ATTR_UNDERLINE;
+        break;
+      case 22:
+        st.attrs &= ~(IMM_ATTR_BOLD | IMM_ATTR_DIM);
+        break;
+      case 23:
+        st.attrs &= ~IMM_ATTR_ITALIC;
+        break;
+      case 24:
+        st.attrs &= ~IMM_ATTR_UNDERLINE;
+        break;
+      case 25:
+        st.attrs &= ~IMM_ATTR_BLINK;
+        break;
+      case 27:
+        st.attrs &= ~IMM_ATTR_REVERSE;
+        break;
+      case 28:
+        st.attrs &= ~IMM_ATTR_INVISIBLE;
+        break;
+      case 29:
+        st.attrs &= ~IMM_ATTR_STRIKE;
+        break;
+      case 38:
+      case 48: {
+        // Either "38:5:n" in one group or "38;5;n" over several
+        vector<int> args(group.begin() + 1, group.end());
+        auto semicolons = args.empty();
+        if (semicolons) {
+          for (auto j = i + 1; j < groups.size() && j <= i + 4; j++) {
+            args.push_back(groups[j][0]);
+          }
+        }
+        int color;
+        if (extended_color(args, color)) {
+          (val == 38 ? st.fg : st.bg) = color;
+          if (semicolons) {
+            i += args[0] == 5 ? 2 : 4;
+          }
+        }
+        break;
+      }
+      case 39:
+        st.fg = IMM_COLOR_DEFAULT;
+        break;
+      case 49:
+        st.bg = IMM_COLOR_DEFAULT;
+        break;
+      default:
+        if (30 <= val && val <= 37) {
+          st.fg = val - 30;
+        } else if (40 <= val && val <= 47) {
+          st.bg = val - 40;
+        } else if (90 <= val && val <= 97) {
+          st.fg = val - 90 + 8;
+        } else if (100 <= val && val <= 107) {
+          st.bg = val - 100 + 8;
+        }
+        break;
+    }
+  }
+}
+
+// Skips the escape sequence at `pos`, applying it to `st` if it's an SGR,
+// and returns the position after it. A CSI sequence runs up to its final
+// byte, and other sequences are ESC, intermediate bytes and a final byte.
+static size_t skip_escape(string_view line, size_t pos, style& st) {
+  auto size = line.size();
+  pos++;
+  if (pos < size && line[pos] == '[') {
+    auto params_pos = ++pos;
+    while (pos < size && 0x30 <= line[pos] && line[pos] <= 0x3f) {
+      pos++;
+    }
+    auto params_end = pos;
+    while (pos < size && 0x20 <= line[pos] && line[pos] <= 0x2f) {
+      pos++;
+    }
+    if (pos < size) {
+      if (line[pos] == 'm' && params_end == pos) {
+        apply_sgr(line.substr(params_pos, params_end - params_pos), st);
+      }
+      pos++;
+    }
+    return pos;
+  }
+  while (pos < size && 0x20 <= line[pos] && line[pos] <= 0x2f) {
+    pos++;
+  }
+  return min(pos + 1, size);
+}
+
+// Reads the character at `pos`, applying the escape sequences in front of it
+// to `st`. The character is stored in `glyph` and the position after it is
+// returned. `glyph.length` is 0 when only escape sequences are left.
+size_t next_glyph(string_view line, size_t pos, style& st, imm_glyph& glyph,
+                  size_t& col_len) {
+  while (pos < line.size() && line[pos] == 0x1b) {
+    pos = skip_escape(line, pos, st);
+  }
+
+  glyph = imm_glyph{pos, 0, st.attrs, st.fg, st.bg};
+  col_len = 0;
+  if (pos >= line.size()) {
+    return pos;
+  }
+
+  auto char_len = utf8CharLen(line.data(), line.size(), pos, &col_len);
+  if (char_len == 0) {
+    // Invalid UTF-8
+    char_len = 1;
+    col_len = 1;
+  }
+
+  // Overstrike
+  if (pos + char_len + 1 < line.size() && line[pos + char_len] == 0x08) {
+    auto ch = line.substr(pos, char_len);
+    pos += char_len + 1;
+    auto char_len2 = utf8CharLen(line.data(), line.size(), pos, &col_len);
+    if (char_len2 == 0) {
+      char_len2 = 1;
+      col_len = 1;
+    }
+    auto ch2 = line.substr(pos, char_len2);
+    if (ch == "_") {
+      glyph.attrs |= IMM_ATTR_UNDERLINE;
+    }
+    if (ch == ch2) {
+      glyph.attrs |= IMM_ATTR_BOLD;
+    }
+    glyph.offset = pos;
+    glyph.length = char_len2;
+    return pos + char_len2;
+  }
+
+  glyph.length = char_len;
+  return pos + char_len;
+}
+
+size_t columns(string_view line) {
+  size_t cols = 0;
+  size_t pos = 0;
+  style st;
+  imm_glyph glyph;
+  while (pos < line.size()) {
+    // A plain ASCII character is a column, unless what follows it overstrikes
+    // or combines with it
+    auto ch = (unsigned char)line[pos];
+    if (ch < 0x80 && ch != 0x1b && pos + 1 < line.size() &&
+        (unsigned char)line[pos + 1] < 0x80 && line[pos + 1] != 0x08) {
+      cols++;
+      pos++;
+      continue;
+    }
+    size_t col_len = 0;
+    pos = next_glyph(line, pos, st, glyph, col_len);
+    cols += col_len;
+  }
+  return cols;
+}
+
+bool is_invalid_start_char(string_view ch) {
+  return ch == u8"." || ch == u8"," || ch == u8";" || ch == u8"?" ||
+         ch == u8"!" || ch == u8"。" || ch == u8"，" || ch == u8"？" ||
+         ch == u8"！" || ch == u8"･";
+}
+
+// Moves `pos` back to the start of the character it falls in, so that a
+// line can be cut there. An overstrike or an escape sequence isn't cut either.
+size_t segment_start(string_view line, size_t pos) {
+  if (pos >= line.size()) {
+    return line.size();
+  }
+  while (pos > 0 && (line[pos] & 0xc0) == 0x80) {
+    pos--;
+  }
+  if (pos > 0 && line[pos] == 0x08) {
+    return segment_start(line, pos - 1);
+  }
+  if (pos > 1 && line[pos - 1] == 0x08) {
+    return segment_start(line, pos - 2);
+  }
+  for (size_t i = pos; i > 0 && pos - i < 32; i--) {
+    auto c = line[i - 1];
+    if (c == 0x1b) return i - 1;
+    if (c < 0x20 || (0x40 <= c && c != '[')) break;
+  }
+  return pos;
+}
+
+// Stores the display lines of `line` in `lines`, reusing its storage
+void fold_line(string_view line, size_t cols, bool word_warp,
+               vector<imm_span>& lines) {
+  lines.clear();
+
+  auto push = [&](size_t start, size_t end) {
+    lines.push_back(imm_span{start, end - start, 0});
+  };
+
+  if (line.empty()) {
+    push(0, 0);
+    return;
+  }
+
+  size_t pos = 0;
+  size_t start = 0;
+  size_t col = 0;
+  style st;
+
+  while (pos < line.size()) {
+    // Escape sequences stay in front of the character they precede, so a
+    // line break never separates them.
+    auto begin = pos;
+    imm_glyph glyph;
+    size_t col_len = 0;
+    auto next = next_glyph(line, pos, st, glyph, col_len);
+
+    if (col + col_len <= cols) {
+      col += col_len;
+      pos = next;
+    } else {
+      auto ch = line.substr(glyph.offset, glyph.length);
+      if (is_invalid_start_char(ch)) {
+        pos = next;
+        push(start, pos);
+        while (pos < line.size()) {
+          if (line[pos] != ' ') {
+            break;
+          }
+          pos++;
+        }
+        start = pos;
+        col = 0;
+      } else {
+        if (ch == u8" ") {
+          push(start, glyph.offset);
+          pos = next;
+          start = pos;
+          col = 0;
+        } else if (word_warp) {
+          auto pos2 = begin - 1;
+          while (start <= pos2 && pos2 != string_view::npos) {
+            if (line[pos2] == ' ') {
+              break;
+            }
+            pos2--;
+          }
+          if (pos2 < start || pos2 == string_view::npos) {
+            push(start, begin);
+            start = begin;
+            col = col_len;
+            pos = next;
+          } else {
+            push(start, pos2);
+            start = pos2 + 1;
+            col = 0;
+            pos = pos2 + 1;
+          }
+        } else {
+          push(start, begin);
+          start = begin;
+          col = col_len;
+          pos = next;
+        }
+      }
+    }
+  }
+
+  if (start < pos) {
+    push(start, pos);
+  }
+}
+
+vector<imm_span> fold_line(string_view line, size_t cols, bool word_warp) {
+  vector<imm_span> lines;
+  fold_line(line, cols, word_warp, lines);
+  return lines;
+}
+
+// Style in effect at `pos` after the escape sequences before it, starting
+// from `st`. Only the escape sequences are looked at.
+style style_at(string_view line, size_t pos, style st) {
+  pos = min(pos, line.size());
+  size_t i = 0;
+  while (i < pos) {
+    auto p = memchr(line.data() + i, 0x1b, pos - i);
+    if (!p) break;
+    i = skip_escape(line.substr(0, pos),
+                    static_cast<const char*>(p) - line.data(), st);
+  }
+  return st;
+}
+
+// Glyphs of a line, or of a part of one that starts in style `st`
+vector<imm_glyph> attribute_line(string_view line, style st) {
+  vector<imm_glyph> result;
+  size_t pos = 0;
+  while (pos < line.size()) {
+    imm_glyph glyph;
+    size_t col_len = 0;
+    pos = next_glyph(line, pos, st, glyph, col_len);
+    if (glyph.length > 0) {
+      result.push_back(glyph);
+    }
+  }
+  return result;
+}
+
+// Adds checkpoints to `index` until one lies within kColumnStep columns
+// before `col`. Scanning resumes from the last checkpoint, so the index only
+// ever covers as much of the line as has been scrolled to.
+void extend_column_index(string_view line, vector<column_checkpoint>& index,
+                         size_t col) {
+  if (index.empty()) {
+    index.push_back(column_checkpoint{0, 0, style()});
+  }
+
+  auto last = index.back();
+  auto pos = last.pos;
+  auto c = last.col;
+  auto st = last.st;
+  while (pos < line.size() && index.back().col + kColumnStep <= col) {
+    if (c >= index.back().col + kColumnStep) {
+      index.push_back(column_checkpoint{c, pos, st});
+    }
+    imm_glyph glyph;
+    size_t col_len = 0;
+    pos = next_glyph(line, pos, st, glyph, col_len);
+    c += col_len;
+  }
+}
+
+// Glyphs within columns [col, col + cols) of a line. `lead` is set to the
+// number of blank columns left by a wide character cut at the left edge.
+vector<imm_glyph> attribute_columns(string_view line,
+                                    vector<column_checkpoint>& index,
+                                    size_t col, size_t cols, size_t& lead) {
+  extend_column_index(line, index, col);
+  auto it = upper_bound(
+      index.begin(), index.end(), col,
+      [](size_t col, const column_checkpoint& cp) { return col < cp.col; });
+  auto& cp = *(it - 1);
+
+  vector<imm_glyph> result;
+  auto pos = cp.pos;
+  auto c = cp.col;
+  auto st = cp.st;
+  lead = 0;
+  while (pos < line.size() && c < col + cols) {
+    imm_glyph glyph;
+    size_t col_len = 0;
+    pos = next_glyph(line, pos, st, glyph, col_len);
+    if (c + col_len > col + cols) {
+      break;
+    }
+    if (c >= col) {
+      if (glyph.length > 0) {
+        result.push_back(glyph);
+      }
+    } else if (c + col_len > col) {
+      lead = c + col_len - col;
+    }
+    c += col_len;
+  }
+  return result;
+}
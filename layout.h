@@ -0,0 +1,54 @@
+#ifndef LAYOUT_H
+#define LAYOUT_H
+
+#include <string_view>
+#include <vector>
+
+#include "immersion.h"
+
+struct style {
+  unsigned int attrs = 0;
+  int fg = IMM_COLOR_DEFAULT;
+  int bg = IMM_COLOR_DEFAULT;
+};
+
+// Byte position and style at a column, recorded every few hundred columns so
+// that a long line can be entered in the middle
+struct column_checkpoint {
+  size_t col;
+  size_t pos;
+  style st;
+};
+
+// Lines longer than this are folded in segments of about this many bytes, so
+// that only the part of a huge line on screen has to be folded.
+const size_t kSegmentBytes = 64 * 1024;
+
+size_t next_glyph(std::string_view line, size_t pos, style& st,
+                  imm_glyph& glyph, size_t& col_len);
+
+size_t columns(std::string_view line);
+
+bool is_invalid_start_char(std::string_view ch);
+
+size_t segment_start(std::string_view line, size_t pos);
+
+void fold_line(std::string_view line, size_t cols, bool word_warp,
+               std::vector<imm_span>& lines);
+
+std::vector<imm_span> fold_line(std::string_view line, size_t cols,
+                                bool word_warp);
+
+style style_at(std::string_view line, size_t pos, style st = style());
+
+std::vector<imm_glyph> attribute_line(std::string_view line,
+                                      style st = style());
+
+void extend_column_index(std::string_view line,
+                         std::vector<column_checkpoint>& index, size_t col);
+
+std::vector<imm_glyph> attribute_columns(
+    std::string_view line, std::vector<column_checkpoint>& index, size_t col,
+    size_t cols, size_t& lead);
+
+#endif /* LAYOUT_H */
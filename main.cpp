@@ -1,346 +1,550 @@
+#include <fcntl.h>
+#include <getopt.h>
 #include <locale.h>
 #include <ncurses.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/ioctl.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 
 #include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
 #include <fstream>
+#include <future>
 #include <iostream>
-#include <sstream>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
-#include "utf8.h"
+#include "colors.h"
+#include "daemon.h"
+#include "layout.h"
+#include "render.h"
+#include "source.h"
+#include "view.h"
 
 using namespace std;
 
 #define ROWS_ ((size_t)LINES)
 #define COLS_ ((size_t)COLS)
 
-template <typename T, typename U>
-vector<T> filter(const vector<T>& vec, U fn) {
-  vector<T> out;
-  copy_if(vec.begin(), vec.end(), back_inserter(out),
-          [fn](const T& val) { return fn(val); });
-  return out;
+static const int kResizeDelay = 100;  // ms
+static const size_t kMinPaneRows = 3;
+static const int kIdleDelay = 200;  // ms
+static const size_t kPrefetchPages = 3;
+static const int kReloadDelay = 100;  // ms
+static const size_t kColumnIndexLines = 1024;
+
+// The event loop sleeps in poll() until one of these pipes is written to: by
+// the SIGWINCH handler, or by a worker whose result the loop takes in.
+static int signal_pipe[2] = {-1, -1};
+static int wake_pipe[2] = {-1, -1};
+
+static bool open_pipe(int fds[2]) {
+  if (pipe(fds) != 0) return false;
+  for (int i = 0; i < 2; i++) {
+    fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+    fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+  }
+  return true;
+}
+
+static void notify(int fd) {
+  auto saved = errno;
+  char c = 0;
+  auto n = write(fd, &c, 1);  // a full pipe already has a wakeup queued
+  (void)n;
+  errno = saved;
 }
 
-auto read_lines(istream& in) {
-  vector<string> lines;
-  string line;
-  while (getline(in, line)) {
-    lines.push_back(line);
+static void drain(int fd) {
+  char buf[64];
+  while (read(fd, buf, sizeof(buf)) > 0) {
   }
-  return lines;
 }
 
-size_t columns(const string& line) {
-  size_t cols = 0;
-  size_t pos = 0;
-  while (pos < line.size()) {
-    size_t col_len = 0;
-    auto char_len = utf8CharLen(line.data(), line.size(), pos, &col_len);
+static void wake_event_loop() {
+  if (wake_pipe[1] >= 0) notify(wake_pipe[1]);
+}
 
-    if (line[pos] == 0x1b) {
-      pos += char_len;
+static void on_sigwinch(int) { notify(signal_pipe[1]); }
 
-      while (pos < line.size()) {
-        size_t col_len2 = 0;
-        auto char_len2 = utf8CharLen(line.data(), line.size(), pos, &col_len2);
-        auto ch2 = line.substr(pos, char_len2);
+template <typename T>
+bool is_ready(const future<T>& f) {
+  return f.valid() && f.wait_for(chrono::seconds(0)) == future_status::ready;
+}
 
-        pos += char_len2;
+// Threads started by run_worker(), joined once they're done or at quit. Only
+// the input thread touches this.
+struct worker {
+  thread runner;
+  shared_ptr<atomic<bool>> done;
+};
+static vector<worker> workers;
+
+// Runs `fn` on a thread of its own, and wakes the event loop once its result
+// is ready. Unlike with async(), dropping the future doesn't wait for it.
+template <typename Fn>
+auto run_worker(Fn fn) -> future<decltype(fn())> {
+  workers.erase(remove_if(workers.begin(), workers.end(),
+                          [](worker& w) {
+                            if (!*w.done) return false;
+                            w.runner.join();
+                            return true;
+                          }),
+                workers.end());
+  auto result = make_shared<promise<decltype(fn())>>();
+  auto f = result->get_future();
+  auto done = make_shared<atomic<bool>>(false);
+  workers.push_back({thread([result, done, fn = move(fn)]() mutable {
+                       result->set_value(fn());
+                       wake_event_loop();
+                       *done = true;
+                     }),
+                     done});
+  return f;
+}
 
-        if (ch2[0] == 'm') {
-          char_len = utf8CharLen(line.data(), line.size(), pos, &col_len);
-          pos += char_len;
-          break;
-        }
-      }
-      char_len = utf8CharLen(line.data(), line.size(), pos, &col_len);
-    } else if (pos + char_len < line.size() && line[pos + char_len] == 0x08) {
-      pos += char_len + 1;
-      char_len = utf8CharLen(line.data(), line.size(), pos, &col_len);
-    } else {
-      pos += char_len;
-    }
+static void join_workers() {
+  for (auto& w : workers) {
+    w.runner.join();
+  }
+  workers.clear();
+}
 
-    cols += col_len;
+using attributed_line = vector<pair<string, chtype>>;
+
+chtype to_chtype(const imm_glyph& glyph) {
+  chtype type = A_NORMAL;
+  if (glyph.attrs & IMM_ATTR_BOLD) type |= A_BOLD;
+  if (glyph.attrs & IMM_ATTR_UNDERLINE) type |= A_UNDERLINE;
+  if (glyph.attrs & IMM_ATTR_DIM) type |= A_DIM;
+#ifdef A_ITALIC
+  if (glyph.attrs & IMM_ATTR_ITALIC) type |= A_ITALIC;
+#endif
+  if (glyph.attrs & IMM_ATTR_BLINK) type |= A_BLINK;
+  if (glyph.attrs & IMM_ATTR_REVERSE) type |= A_REVERSE;
+  if (glyph.attrs & IMM_ATTR_INVISIBLE) type |= A_INVIS;
+  return type | COLOR_PAIR(color_pair(glyph.fg, glyph.bg));
+}
+
+bool same_style(const imm_glyph& a, const imm_glyph& b) {
+  return a.attrs == b.attrs && a.fg == b.fg && a.bg == b.bg;
+}
+
+// Joins runs of glyphs in the same style, so that a color pair is looked up
+// once per run rather than for every glyph.
+void append_glyphs(attributed_line& result, string_view line,
+                   const vector<imm_glyph>& glyphs) {
+  for (size_t i = 0; i < glyphs.size();) {
+    string text;
+    auto j = i;
+    for (; j < glyphs.size() && same_style(glyphs[i], glyphs[j]); j++) {
+      text += line.substr(glyphs[j].offset, glyphs[j].length);
+    }
+    result.emplace_back(move(text), to_chtype(glyphs[i]));
+    i = j;
   }
-  return cols;
 }
 
-bool is_invalid_start_char(const string& ch) {
-  return ch == u8"." || ch == u8"," || ch == u8";" || ch == u8"?" ||
-         ch == u8"!" || ch == u8"。" || ch == u8"，" || ch == u8"？" ||
-         ch == u8"！" || ch == u8"･";
+attributed_line to_attributed_line(const styled_row& row) {
+  attributed_line result;
+  for (auto& run : row) {
+    result.emplace_back(run.text, to_chtype(run.style));
+  }
+  return result;
 }
 
-auto fold_line(const string& line, size_t cols, bool word_warp) {
-  vector<string> lines;
+attributed_line chop_line(string_view line,
+                          vector<column_checkpoint>& index, size_t col,
+                          size_t cols) {
+  size_t lead = 0;
+  auto glyphs = attribute_columns(line, index, col, cols, lead);
 
-  if (line.empty()) {
-    lines.push_back(string());
-    return lines;
+  attributed_line result;
+  if (lead > 0) {
+    result.emplace_back(string(lead, ' '), A_NORMAL);
   }
+  append_glyphs(result, line, glyphs);
+  return result;
+}
 
-  size_t pos = 0;
-  size_t start = 0;
-  size_t col = 0;
+void draw_line(const attributed_line& line, chtype extra = A_NORMAL) {
+  for (auto& [ch, att] : line) {
+    attron(att | extra);
+    addstr(ch.c_str());
+    attroff(att | extra);
+  }
+}
 
-  auto init = true;
-  while (pos < line.size()) {
-    size_t col_len = 0;
-    auto char_len = utf8CharLen(line.data(), line.size(), pos, &col_len);
+// Lines appended to the source of a document, or the file reopened when it
+// changed otherwise. `src` is null if it couldn't be reopened.
+struct reloaded {
+  shared_ptr<source> scanned;
+  appended_lines lines;
+  shared_ptr<source> src;
+};
 
-    // Skip attribute
-    if (line[pos] == 0x1b) {
-      pos += char_len;
+struct Document {
+  string path;
+  shared_ptr<source> src = make_shared<source>();
+  bool loaded = false;
 
-      while (pos < line.size()) {
-        size_t col_len2 = 0;
-        auto char_len2 = utf8CharLen(line.data(), line.size(), pos, &col_len2);
-        auto ch2 = line.substr(pos, char_len2);
+  // What was appended to the file after it changed, and when to look again
+  future<reloaded> reload_job;
+  bool reload_pending = false;
+  chrono::steady_clock::time_point reload_at;
 
-        pos += char_len2;
+  size_t cols = 0;
+  bool fixed_cols = false;
+
+  // Layout for the current options, completed by `layout_job`
+  shared_ptr<view_layout> layout;
+  future<void> layout_job;
+
+  // Pages around the view being laid out and styled ahead while idle
+  future<void> prefetch_job;
+  shared_ptr<atomic<bool>> prefetch_cancelled;
+  bool forward = true;
+
+  // Column checkpoints of the lines scrolled horizontally in chop mode. They
+  // are dropped when the view scrolls back to the left edge, or when there
+  // are more than kColumnIndexLines.
+  unordered_map<size_t, vector<column_checkpoint>> column_indexes;
+
+  // Top of each pane the view is split into, and the pane keys go to
+  vector<anchor> panes = vector<anchor>(1);
+  size_t focus = 0;
+
+  size_t hscroll = 0;
+  size_t last_used = 0;
+};
+
+void load_document(Document& doc,
+                   const atomic<bool>* cancelled = nullptr) {
+  if (!cancelled || !*cancelled) {
+    request_index(doc.path);
+  }
+  doc.src = make_shared<source>();
+  if (doc.src->open(doc.path, cancelled)) {
+    doc.panes.assign(1, anchor{doc.src->position().line, 0, 0});
+    doc.focus = 0;
+    doc.hscroll = doc.src->position().hscroll;
+  } else {
+    auto message = "failed to open " + doc.path + " file...";
+    doc.src->assign(vector<char>(message.begin(), message.end()));
+  }
+  doc.loaded = true;
+}
 
-        if (ch2[0] == 'm') {
-          char_len = utf8CharLen(line.data(), line.size(), pos, &col_len);
-          break;
-        }
+// Replaces the layout of a document, cancelling the one in progress. The
+// text at the top of each pane stays there, and the rest of the document is
+// folded on a worker thread.
+void layout_document(Document& doc, const layout_options& opts) {
+  auto layout = make_shared<view_layout>(doc.src, opts);
+  if (doc.layout) {
+    doc.layout->cancel();
+  }
+  for (auto& pane : doc.panes) {
+    if (doc.layout) {
+      auto top = doc.layout->normalize(pane);
+      if (top.line < doc.src->line_count() &&
+          doc.layout->row_count(top.line, top.segment) > 0) {
+        auto row = doc.layout->row(top);
+        pane = row.is_spacer() ? anchor{top.line, 0, 0}
+                               : layout->anchor_at(top.line, row.offset);
       }
-      char_len = utf8CharLen(line.data(), line.size(), pos, &col_len);
-    } else if (pos + char_len < line.size() && line[pos + char_len] == 0x08) {
-      pos += char_len + 1;
-      char_len = utf8CharLen(line.data(), line.size(), pos, &col_len);
     }
+    pane = layout->normalize(pane);
+  }
+  doc.layout = layout;
+  doc.layout_job =
+      async(launch::async, [layout, line = doc.panes[doc.focus].line] {
+        layout->complete(line);
+      });
+}
 
-    if (col + col_len <= cols) {
-      col += col_len;
-      pos += char_len;
-    } else {
-      auto ch = line.substr(pos, char_len);
-      if (is_invalid_start_char(ch)) {
-        pos += char_len;
-        lines.push_back(line.substr(start, pos - start));
-        while (pos < line.size()) {
-          if (line[pos] != ' ') {
-            break;
-          }
-          pos++;
-        }
-        start = pos;
-        col = 0;
-      } else {
-        if (ch == u8" ") {
-          lines.push_back(line.substr(start, pos - start));
-          pos += char_len;
-          start = pos;
-          col = 0;
-        } else if (word_warp) {
-          auto pos2 = pos - 1;
-          while (start <= pos2) {
-            if (line[pos2] == ' ') {
-              break;
-            }
-            pos2--;
-          }
-          if (pos2 < start) {
-            lines.push_back(line.substr(start, pos - start));
-            start = pos;
-            col = col_len;
-            pos += char_len;
-          } else {
-            lines.push_back(line.substr(start, pos2 - start));
-            start = pos2 + 1;
-            col = 0;
-            pos = pos2 + 1;
-          }
-        } else {
-          lines.push_back(line.substr(start, pos - start));
-          start = pos;
-          col = col_len;
-          pos += char_len;
-        }
-      }
+attributed_line display_line(Document& doc, const anchor& a) {
+  auto row = doc.layout->row(a);
+  if (row.is_spacer()) {
+    return attributed_line();
+  }
+  auto line = doc.src->line(a.line);
+  if (doc.layout->options().chop) {
+    if (doc.hscroll == 0) {
+      vector<column_checkpoint> index;
+      return chop_line(line, index, 0, doc.cols);
+    }
+    if (doc.column_indexes.size() >= kColumnIndexLines &&
+        !doc.column_indexes.count(a.line)) {
+      doc.column_indexes.clear();
     }
+    return chop_line(line, doc.column_indexes[a.line], doc.hscroll, doc.cols);
   }
+  return to_attributed_line(*doc.layout->styled(a));
+}
 
-  if (start < pos) {
-    lines.push_back(line.substr(start, pos - start));
+size_t document_cols(const Document& doc, size_t opt_cols,
+                     size_t max_view_cols) {
+  if (doc.fixed_cols) return doc.cols;
+  return opt_cols > 0 ? opt_cols : min(doc.src->max_cols(), max_view_cols);
+}
+
+// Loads and lays out a document off the input thread, so that switching to
+// it only has to move the result in. Once cancelled, it stops loading and
+// isn't laid out.
+Document prefetch_document(Document doc, size_t opt_cols,
+                           size_t max_view_cols, layout_options opts,
+                           const atomic<bool>& cancelled) {
+  if (!doc.loaded) {
+    load_document(doc, &cancelled);
+  }
+  if (cancelled) {
+    return doc;
   }
+  doc.cols = opts.cols = document_cols(doc, opt_cols, max_view_cols);
+  if (!doc.layout || doc.layout->options() != opts) {
+    layout_document(doc, opts);
+  }
+  return doc;
+}
 
-  return lines;
+// Indexes what was appended to the file of a document on a worker thread.
+// If it changed otherwise, it's reopened, and only what was appended gets
+// indexed, thanks to the cache.
+void reload_document(Document& doc) {
+  doc.reload_pending = false;
+  doc.reload_job = run_worker([path = doc.path, src = doc.src] {
+    reloaded result;
+    if (src->scan_appended(result.lines)) {
+      result.scanned = src;
+      return result;
+    }
+    request_index(path);
+    result.src = make_shared<source>();
+    if (!result.src->open(path)) {
+      result.src.reset();
+    }
+    return result;
+  });
 }
 
-template <typename Out>
-void split(const std::string& s, char delim, Out result) {
-  std::istringstream iss(s);
-  std::string item;
-  while (std::getline(iss, item, delim)) {
-    *result++ = std::stoi(item);
+void cancel_prefetch(Document& doc) {
+  if (doc.prefetch_cancelled) {
+    *doc.prefetch_cancelled = true;
   }
 }
 
-std::vector<int> split(const std::string& s, char delim) {
-  std::vector<int> elems;
-  split(s, delim, std::back_inserter(elems));
-  return elems;
+// Takes in the lines appended to the source, folding only those, or swaps in
+// a reopened source. A pane that showed the end of the file follows it to the
+// new end.
+void update_document(Document& doc, reloaded r, size_t height) {
+  auto& top = doc.panes[doc.focus];
+  auto following =
+      doc.layout && doc.layout->count(top, height + 1) <= height;
+  if (r.scanned) {
+    if (r.scanned != doc.src || r.lines.widths.empty()) {
+      return;
+    }
+    // The workers using the source are stopped while it changes
+    cancel_prefetch(doc);
+    if (doc.prefetch_job.valid()) {
+      doc.prefetch_job.wait();
+    }
+    if (doc.layout) {
+      doc.layout->cancel();
+    }
+    if (doc.layout_job.valid()) {
+      doc.layout_job.wait();
+    }
+    doc.src->append(r.lines);
+    doc.column_indexes.erase(r.lines.first);
+    if (doc.layout) {
+      doc.layout->extend(r.lines.first);
+      for (auto& pane : doc.panes) {
+        pane = doc.layout->normalize(pane);
+      }
+      doc.layout_job = async(launch::async, [layout = doc.layout,
+                                             line = top.line] {
+        layout->complete(line);
+      });
+    }
+  } else {
+    doc.src = move(r.src);
+    doc.column_indexes.clear();
+    if (doc.layout) {
+      layout_document(doc, doc.layout->options());
+    }
+  }
+  if (following) {
+    top = doc.layout->end();
+  }
 }
 
-auto to_attributed_line(const string& line) {
-  vector<pair<string, chtype>> result;
+size_t memory_usage(const Document& doc) {
+  auto size = doc.src->memory_usage();
+  if (doc.layout) {
+    size += doc.layout->memory_usage();
+  }
+  for (auto& [_, index] : doc.column_indexes) {
+    size += sizeof(index) + index.capacity() * sizeof(index[0]);
+  }
+  return size;
+}
 
-  chtype type = A_NORMAL;
-  size_t pos = 0;
-  while (pos < line.size()) {
-    size_t col_len = 0;
-    auto char_len = utf8CharLen(line.data(), line.size(), pos, &col_len);
-    auto ch = line.substr(pos, char_len);
-
-    if (ch[0] == 0x1b) {
-      auto esc_start_pos = pos;
-      pos += char_len;
-
-      while (pos < line.size()) {
-        size_t col_len2 = 0;
-        auto char_len2 = utf8CharLen(line.data(), line.size(), pos, &col_len2);
-        auto ch2 = line.substr(pos, char_len2);
-
-        pos += char_len2;
-
-        if (ch2[0] == 'm') {
-          type = A_NORMAL;
-          esc_start_pos += 2;
-          auto esc_len = pos - esc_start_pos - 1;
-          if (esc_len > 0) {
-            auto esc_values = line.substr(esc_start_pos, esc_len);
-            auto vals = split(esc_values, ';');
-            for (auto val : vals) {
-              switch (val) {
-                case 1:
-                  type |= A_BOLD;
-                  break;
-                case 4:
-                  type |= A_UNDERLINE;
-                  break;
-                case 30:
-                case 31:
-                case 32:
-                case 33:
-                case 34:
-                case 35:
-                case 36:
-                case 37:
-                  type |= COLOR_PAIR(val);
-                  break;
-              }
-            }
+// Lays out and styles the pages next to the pane with focus on a worker
+// thread: a few pages in the direction of the last scroll, nearest first,
+// then the page on the other side. It stops as soon as it's cancelled.
+void prefetch_pages(Document& doc, size_t height) {
+  auto cancelled = make_shared<atomic<bool>>(false);
+  doc.prefetch_cancelled = cancelled;
+  doc.prefetch_job = async(
+      launch::async, [layout = doc.layout, top = doc.panes[doc.focus],
+                      forward = doc.forward, height, cancelled] {
+        auto prefetch = [&](size_t page, bool ahead) {
+          auto dir = ahead ? forward : !forward;
+          auto a = top;
+          auto moved = layout->step(a, page * height, dir);
+          if (moved == 0 || (dir && moved < page * height)) return;
+          for (size_t i = 0; i < height && !*cancelled; i++) {
+            layout->styled(a);
+            if (layout->step(a, 1, true) == 0) break;
           }
-          break;
+        };
+        for (size_t page = 1; page <= kPrefetchPages && !*cancelled; page++) {
+          prefetch(page, true);
         }
-      }
-    } else if (pos + char_len < line.size() && line[pos + char_len] == 0x08) {
-      pos += char_len + 1;
-
-      size_t col_len2 = 0;
-      auto char_len2 = utf8CharLen(line.data(), line.size(), pos, &col_len2);
-      auto ch2 = line.substr(pos, char_len2);
+        if (!*cancelled) {
+          prefetch(1, false);
+        }
+      });
+}
 
-      pos += char_len2;
-      if (ch == "_") {
-        result.emplace_back(ch2, A_UNDERLINE);
-      }
-      if (ch == ch2) {
-        result.emplace_back(ch2, A_BOLD);
-      }
-    } else {
-      pos += char_len;
-      result.emplace_back(ch, type);
-    }
+void evict_document(Document& doc) {
+  cancel_prefetch(doc);
+  doc.prefetch_job = future<void>();
+  if (doc.layout) {
+    doc.layout->cancel();
   }
-
-  return result;
+  doc.layout_job = future<void>();
+  doc.reload_job = future<reloaded>();
+  doc.reload_pending = false;
+  doc.layout.reset();
+  doc.src = make_shared<source>();
+  doc.column_indexes.clear();
+  doc.loaded = false;
 }
 
-size_t max_colums(const vector<string>& lines) {
-  size_t cols = 0;
-  for (auto& line : lines) {
-    cols = max(cols, columns(line));
-  }
-  return cols;
+// How many panes of at least kMinPaneRows rows fit in `rows` rows
+size_t max_panes(size_t rows) {
+  return max<size_t>((rows + 1) / (kMinPaneRows + 1), 1);
 }
 
-auto fold_lines(const vector<string>& lines, size_t cols, bool linespace,
-                bool word_warp) {
-  auto filtered =
-      filter(lines, [&](auto& line) { return !linespace || !line.empty(); });
+// Splits `rows` rows into `count` panes with a divider between each, and
+// returns where pane `index` starts and how tall it is. Panes that don't fit
+// are empty.
+void pane_rows(size_t rows, size_t count, size_t index, size_t& y,
+               size_t& height) {
+  auto h = rows >= count - 1 ? (rows - (count - 1)) / count : 0;
+  y = min(index * (h + 1), rows);
+  height = index + 1 == count ? rows - y : h;
+}
 
-  vector<vector<pair<string, chtype>>> out;
-  auto init = true;
-  for (auto line : filtered) {
-    if (init) {
-      init = false;
-    } else if (linespace) {
-      out.push_back(to_attributed_line(string()));
-    }
-    for (auto l : fold_line(line, cols, word_warp)) {
-      out.push_back(to_attributed_line(l));
-    }
+// Draws `line_count` display lines from the top of a pane, or centers the
+// whole document when it's shorter than the pane. Only the rows of the pane
+// are touched, and panes without focus are dimmed.
+void draw_pane(Document& doc, size_t index, size_t line_count, size_t cols,
+               size_t y, size_t height) {
+  for (size_t i = 0; i < height; i++) {
+    move(y + i, 0);
+    clrtoeol();
+  }
+  auto att = doc.panes.size() > 1 && index != doc.focus ? A_DIM : A_NORMAL;
+  auto a = doc.panes[index];
+  if (line_count < height) {
+    a = doc.layout->normalize(anchor());
+    y += height / 2 - line_count / 2;
+  }
+  auto count = min(line_count, height);
+  for (size_t i = 0; i < count; i++) {
+    if (i > 0 && doc.layout->step(a, 1, true) == 0) break;
+    int x = COLS_ / 2 - cols / 2;
+    move(y + i, x);
+    draw_line(display_line(doc, a), att);
   }
-  return out;
 }
 
-void draw(const vector<vector<pair<string, chtype>>>& lines, size_t cols,
-          size_t current_line, size_t margin) {
+void draw(Document& doc, size_t line_count, size_t cols, size_t margin) {
+  begin_color_frame();
   auto view_lines = ROWS_ - margin * 2;
-  if (lines.size() < view_lines) {
-    int y = ROWS_ / 2 - lines.size() / 2;
-    size_t i = 0;
-    for (auto& line : lines) {
-      int x = COLS_ / 2 - cols / 2;
-      move(y + i, x);
-      for (auto& [ch, att] : line) {
-        attron(att);
-        printw(ch.c_str());
-        attroff(att);
-      }
-      i++;
-    }
-  } else {
-    auto y = margin;
-    for (size_t i = 0; i < view_lines; i++) {
-      auto& line = lines[current_line + i];
-      int x = COLS_ / 2 - cols / 2;
-      move(y + i, x);
-      for (auto& [ch, att] : line) {
-        attron(att);
-        printw(ch.c_str());
-        attroff(att);
-      }
+  for (size_t i = 0; i < doc.panes.size(); i++) {
+    size_t y, height;
+    pane_rows(view_lines, doc.panes.size(), i, y, height);
+    draw_pane(doc, i, line_count, cols, margin + y, height);
+    if (i + 1 < doc.panes.size()) {
+      attron(A_DIM);
+      mvhline(margin + y + height, COLS_ / 2 - cols / 2, ACS_HLINE, cols);
+      attroff(A_DIM);
     }
   }
 }
 
 size_t calc_margin(size_t rows, size_t min_margin, size_t line_count) {
-  rows = rows > 0 ? rows : ROWS_ - min_margin * 2;
+  min_margin = min(min_margin, ROWS_ / 2);
+  rows = rows > 0 ? min(rows, ROWS_) : ROWS_ - min_margin * 2;
   return max((ROWS_ - min(rows, line_count)) / 2, min_margin);
 }
 
-size_t calc_page_lines(size_t display_lines, size_t rows, size_t& bottom_line) {
-  auto page_lines = display_lines;
-  bottom_line = 0;
-  if (display_lines > rows) {
-    page_lines = min(display_lines, rows);
-    bottom_line = display_lines - page_lines;
+// Width of the terminal on stdout, $COLUMNS or 80, for --render
+size_t page_cols() {
+  struct winsize ws;
+  if (ioctl(1, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0) {
+    return ws.ws_col;
+  }
+  auto columns = getenv("COLUMNS");
+  if (columns && atoi(columns) > 0) {
+    return atoi(columns);
+  }
+  return 80;
+}
+
+// Writes the files, or stdin when there are none, laid out to stdout
+int render_files(int argc, char* const* argv, const layout_options& opts,
+                 size_t page_cols) {
+  renderer r(stdout, opts, page_cols);
+  if (argc == 0) {
+    return r.render(0) ? 0 : -1;
   }
-  return page_lines;
+  for (int i = 0; i < argc; i++) {
+    int fd = open(argv[i], O_RDONLY);
+    if (fd < 0 || !r.render(fd)) {
+      cerr << "failed to open " << argv[i] << " file..." << endl;
+      return -1;
+    }
+    close(fd);
+  }
+  return 0;
 }
 
 void parse_command_line(int argc, char* const* argv, size_t& cols, size_t& rows,
-                        size_t& min_margin, bool& linespace, bool& word_warp) {
+                        size_t& min_margin, size_t& memory_budget,
+                        bool& linespace, bool& word_warp, bool& chop,
+                        bool& render, bool& daemon) {
+  static const option long_options[] = {
+      {"render", no_argument, nullptr, 'R'},
+      {"daemon", no_argument, nullptr, 'D'},
+      {nullptr, 0, nullptr, 0},
+  };
   int opt;
   opterr = 0;
-  while ((opt = getopt(argc, argv, "r:c:m:sw")) != -1) {
+  while ((opt = getopt_long(argc, argv, "r:c:m:M:swS", long_options,
+                            nullptr)) != -1) {
     switch (opt) {
       case 'r':
         rows = stoi(optarg);
@@ -351,12 +555,24 @@ void parse_command_line(int argc, char* const* argv, size_t& cols, size_t& rows,
       case 'm':
         min_margin = stoi(optarg);
         break;
+      case 'M':
+        memory_budget = stoul(optarg) * 1024 * 1024;
+        break;
       case 's':
         linespace = true;
         break;
       case 'w':
         word_warp = true;
         break;
+      case 'S':
+        chop = true;
+        break;
+      case 'R':
+        render = true;
+        break;
+      case 'D':
+        daemon = true;
+        break;
     }
   }
 }
@@ -365,45 +581,79 @@ int main(int argc, char* const* argv) {
   size_t opt_cols = 0;
   size_t opt_rows = 0;
   size_t opt_min_margin = 2;
+  size_t opt_memory_budget = 256 * 1024 * 1024;
   bool opt_linespace = false;
   bool opt_word_wrap = false;
+  bool opt_chop = false;
+  bool opt_render = false;
+  bool opt_daemon = false;
 
   parse_command_line(argc, argv, opt_cols, opt_rows, opt_min_margin,
-                     opt_linespace, opt_word_wrap);
+                     opt_memory_budget, opt_linespace, opt_word_wrap,
+                     opt_chop, opt_render, opt_daemon);
   argc -= optind;
   argv += optind;
 
-  vector<string> lines;
+  if (opt_daemon) {
+    index_daemon daemon;
+    if (!daemon.listen()) {
+      return -1;
+    }
+    daemon.run();
+    return 0;
+  }
+
+  if (opt_render) {
+    auto page = page_cols();
+    layout_options opts;
+    opts.cols = opt_cols > 0 ? opt_cols : page - min(page, opt_min_margin * 2);
+    opts.cols = max(opts.cols, (size_t)1);
+    opts.linespace = opt_linespace;
+    opts.chop = opt_chop;
+    opts.word_warp = opt_word_wrap;
+    return render_files(argc, argv, opts, page);
+  }
+
+  vector<Document> docs;
   if (!isatty(0)) {
-    lines = read_lines(cin);
+    docs.emplace_back();
+    docs.back().src->read(0);
     freopen("/dev/tty", "rw", stdin);
   } else {
     if (argc > 0) {
-      auto path = argv[0];
-      ifstream ifs(path);
-      if (ifs) {
-        lines = read_lines(ifs);
-      } else {
-        cerr << "failed to open " << path << " file..." << endl;
-        return -1;
+      for (int i = 0; i < argc; i++) {
+        auto path = argv[i];
+        if (!ifstream(path)) {
+          cerr << "failed to open " << path << " file..." << endl;
+          return -1;
+        }
+        docs.emplace_back();
+        docs.back().path = path;
       }
+      load_document(docs.front());
     } else {
       opt_cols = 0;
       opt_rows = 0;
-      lines = {
-          "usage: immersion [-sw] [-r rows] [-c cols] [-m margin] [file]",
+      vector<string> usage = {
+          "usage: immersion [-swS] [-r rows] [-c cols] [-m margin] [-M megabytes]",
+          "                 [--render] [--daemon] [file ...]",
           "",
           "  options:",
           "    -s                  line space",
           "    -w                  word wrap",
+          "    -S                  chop long lines",
           "    -r rows             window height",
           "    -c cols             window width",
           "    -m margin           minimun margin",
+          "    -M megabytes        memory budget for inactive files",
+          "    --render            write the layout to stdout and exit",
+          "    --daemon            keep the indexes of opened files up to date",
           "    file                file path",
           "",
           "  commands:",
           "    q              quit",
           "    s              toggle line space",
+          "    S              toggle chop long lines",
           "    i              widen window",
           "    o              narrow window",
           "    I              make window taller",
@@ -416,85 +666,380 @@ int main(int argc, char* const* argv) {
           "    u              half page up",
           "    g              go to top",
           "    G              go to bottom",
+          "    h or [left]    scroll left",
+          "    l or [right]   scroll right",
+          "    n              next file",
+          "    p              previous file",
+          "    x              split pane",
+          "    X              close pane",
+          "    [tab]          switch pane",
       };
+      string text;
+      for (auto& line : usage) {
+        text += line + "\n";
+      }
+      docs.emplace_back();
+      docs.back().src->assign(vector<char>(text.begin(), text.end()));
     }
   }
+  if (docs.front().path.empty()) {
+    docs.front().loaded = true;
+  }
 
   setlocale(LC_CTYPE, "");
 
   initscr();
   noecho();
   curs_set(0);
+  keypad(stdscr, TRUE);
 
   use_default_colors();
   start_color();
-  init_pair(30, COLOR_BLACK, -1);
-  init_pair(31, COLOR_RED, -1);
-  init_pair(32, COLOR_GREEN, -1);
-  init_pair(33, COLOR_YELLOW, -1);
-  init_pair(34, COLOR_BLUE, -1);
-  init_pair(35, COLOR_MAGENTA, -1);
-  init_pair(36, COLOR_CYAN, -1);
-  init_pair(37, COLOR_WHITE, -1);
+  init_color_pairs();
+
+  vector<future<Document>> prefetches(docs.size());
+  auto prefetches_cancelled = make_shared<atomic<bool>>(false);
+  size_t current_doc = 0;
+  size_t use_count = 0;
+  auto doc = &docs[current_doc];
+  doc->last_used = ++use_count;
 
   auto linespace = opt_linespace;
-  auto max_cols = max_colums(lines);
-  auto cols =
-      opt_cols > 0 ? opt_cols : min(max_cols, COLS_ - opt_min_margin * 2);
+  auto chop = opt_chop;
   auto rows = opt_rows;
-
-  auto display_lines = fold_lines(lines, cols, linespace, opt_word_wrap);
-  auto display_cols = min(max_cols, min(cols, COLS_));
-  auto margin = calc_margin(rows, opt_min_margin, display_lines.size());
-  rows = ROWS_ - margin * 2;  // adjust based on actual margin
-  size_t bottom_line = 0;
-  auto page_lines = calc_page_lines(display_lines.size(), rows, bottom_line);
-  int current_line = 0;
-
-  draw(display_lines, display_cols, current_line, margin);
-
-  while (true) {
-    int key = getch();
-    if (key == 'q') break;
-
-    auto scroll_core = [&](int rows, bool forward) {
-      while (rows > 0) {
-        current_line += forward ? 1 : -1;
-        draw(display_lines, display_cols, current_line, margin);
-        refresh();
-        rows--;
+  size_t display_cols = 0;
+  size_t margin = 0;
+  size_t line_count = 0;
+  size_t page_lines = 0;
+
+  auto current_options = [&]() {
+    layout_options opts;
+    opts.cols = doc->cols;
+    opts.linespace = linespace;
+    opts.chop = chop;
+    opts.word_warp = opt_word_wrap;
+    return opts;
+  };
+
+  auto scroll_horizontally = [&](size_t cols, bool forward) {
+    auto max_hscroll =
+        doc->src->max_cols() > doc->cols ? doc->src->max_cols() - doc->cols : 0;
+    doc->hscroll = forward ? min(doc->hscroll + cols, max_hscroll)
+                           : doc->hscroll - min(doc->hscroll, cols);
+    if (doc->hscroll == 0) {
+      doc->column_indexes.clear();
+    }
+  };
+
+  auto pane_at = [&](size_t index, size_t& y, size_t& height) {
+    pane_rows(rows, doc->panes.size(), index, y, height);
+    y += margin;
+  };
+
+  auto pane_height = [&](size_t index) {
+    size_t y, height;
+    pane_at(index, y, height);
+    return height;
+  };
+
+  // Keeps each pane filled down to its bottom line
+  auto clamp_panes = [&]() {
+    for (size_t i = 0; i < doc->panes.size(); i++) {
+      auto& top = doc->panes[i];
+      auto height = pane_height(i);
+      top = doc->layout->normalize(top);
+      auto count = doc->layout->count(top, height);
+      if (count < height) {
+        doc->layout->step(top, height - count, false);
       }
-    };
-
-    auto scroll_forward = [&](size_t rows) {
-      rows = (current_line + rows > bottom_line) ? bottom_line - current_line
-                                                 : rows;
-      scroll_core(rows, true);
-    };
-
-    auto scroll_backword = [&](size_t rows) {
-      rows = (current_line - (int)rows < 0) ? current_line : rows;
-      scroll_core(rows, false);
-    };
+    }
+  };
 
-    auto layout = false;
+  auto relayout = [&]() {
+    doc->cols = document_cols(*doc, opt_cols, COLS_ - opt_min_margin * 2);
+    auto opts = current_options();
+    if (!doc->layout || doc->layout->options() != opts) {
+      layout_document(*doc, opts);
+    }
+    scroll_horizontally(0, true);
+    display_cols = min(doc->src->max_cols(), min(doc->cols, COLS_));
+    line_count =
+        doc->layout->count(doc->layout->normalize(anchor()), ROWS_);
+    margin = calc_margin(rows, opt_min_margin, line_count);
+    rows = ROWS_ - margin * 2;  // adjust based on actual margin
+    // Close the panes that no longer fit, keeping the one with focus
+    while (doc->panes.size() > max_panes(rows)) {
+      auto i = doc->focus + 1 < doc->panes.size() ? doc->panes.size() - 1
+                                                   : doc->panes.size() - 2;
+      doc->panes.erase(doc->panes.begin() + i);
+      if (i < doc->focus) doc->focus--;
+    }
+    page_lines = min(line_count, pane_height(doc->focus));
+    clamp_panes();
+  };
+
+  // Start loading and laying out the file after the current one, so that `n`
+  // finds it ready.
+  auto prefetch_next = [&]() {
+    auto next = current_doc + 1;
+    if (next >= docs.size() || prefetches[next].valid()) return;
+    auto& next_doc = docs[next];
+    if (next_doc.loaded && next_doc.layout) return;
+    auto max_view_cols = COLS_ - opt_min_margin * 2;
+    prefetches[next] = run_worker([d = move(next_doc), opt_cols, max_view_cols,
+                                   opts = current_options(),
+                                   cancelled = prefetches_cancelled]() mutable {
+      return prefetch_document(move(d), opt_cols, max_view_cols, opts,
+                               *cancelled);
+    });
+  };
+
+  // Drop the least recently used inactive files until the total fits in the
+  // budget. Files read from stdin can't be reloaded, so they stay, and so
+  // does the next file, which was prefetched for `n`.
+  auto evict_documents = [&]() {
+    size_t total = 0;
+    vector<size_t> candidates;
+    for (size_t i = 0; i < docs.size(); i++) {
+      if (prefetches[i].valid() || !docs[i].loaded) continue;
+      total += memory_usage(docs[i]);
+      if (i != current_doc && i != current_doc + 1 &&
+          !docs[i].path.empty()) {
+        candidates.push_back(i);
+      }
+    }
+    sort(candidates.begin(), candidates.end(), [&](auto a, auto b) {
+      return docs[a].last_used < docs[b].last_used;
+    });
+    for (auto i : candidates) {
+      if (total <= opt_memory_budget) break;
+      total -= memory_usage(docs[i]);
+      evict_document(docs[i]);
+    }
+  };
+
+  // Reloads of the file on screen are started when inotify reports that it
+  // was written to. Elsewhere files are read once.
+  int inotify_fd = -1;
+  int watch = -1;
+#ifdef __linux__
+  inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
+
+  auto watch_document = [&]() {
+#ifdef __linux__
+    if (inotify_fd < 0) return;
+    if (watch >= 0) {
+      inotify_rm_watch(inotify_fd, watch);
+      watch = -1;
+    }
+    if (!doc->path.empty()) {
+      watch = inotify_add_watch(inotify_fd, doc->path.c_str(), IN_MODIFY);
+    }
+#endif
+  };
+
+  auto file_changed = [&]() {
+    auto changed = false;
+#ifdef __linux__
+    alignas(inotify_event) char buf[4096];
+    ssize_t len;
+    while ((len = read(inotify_fd, buf, sizeof(buf))) > 0) {
+      for (ssize_t i = 0; i < len;) {
+        auto ev = reinterpret_cast<const inotify_event*>(buf + i);
+        if (ev->wd == watch && (ev->mask & IN_MODIFY)) {
+          changed = true;
+        }
+        i += sizeof(inotify_event) + ev->len;
+      }
+    }
+#endif
+    return changed;
+  };
+
+  // Terminal size changes arrive through the self-pipe rather than through
+  // ncurses' own handler, so that poll() wakes up for them.
+  open_pipe(signal_pipe);
+  open_pipe(wake_pipe);
+  struct sigaction sa = {};
+  sa.sa_handler = on_sigwinch;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGWINCH, &sa, nullptr);
+  nodelay(stdscr, TRUE);
+
+  auto input_pending = [&]() {
+    pollfd fd = {fileno(stdin), POLLIN, 0};
+    return poll(&fd, 1, 0) > 0;
+  };
+
+  using steady_clock = chrono::steady_clock;
+  auto resize_pending = false;
+  steady_clock::time_point resize_at;
+  auto idle_pending = false;
+  steady_clock::time_point idle_at;
+
+  // Milliseconds until the nearest timer is due, or -1 with none
+  auto poll_timeout = [&]() {
+    auto deadline = steady_clock::time_point::max();
+    if (resize_pending) deadline = min(deadline, resize_at);
+    if (idle_pending && !resize_pending) deadline = min(deadline, idle_at);
+    if (doc->reload_pending) deadline = min(deadline, doc->reload_at);
+    if (deadline == steady_clock::time_point::max()) return -1;
+    auto ms = chrono::duration_cast<chrono::milliseconds>(
+                  deadline - steady_clock::now())
+                  .count();
+    return (int)max<decltype(ms)>(ms + 1, 0);
+  };
+
+  // A burst of resizes is folded into one relayout once it settles, and the
+  // old frame stays on screen until then.
+  auto schedule_resize = [&]() {
+    resize_pending = true;
+    resize_at = steady_clock::now() + chrono::milliseconds(kResizeDelay);
+  };
+
+  auto resize_terminal = [&]() {
+    struct winsize ws;
+    if (ioctl(fileno(stdout), TIOCGWINSZ, &ws) == 0 && ws.ws_row > 0 &&
+        ws.ws_col > 0) {
+      resizeterm(ws.ws_row, ws.ws_col);
+    }
+    schedule_resize();
+  };
+
+  // What the keys and events of one wakeup leave to be done. It's all drawn
+  // at once at the end.
+  auto layout = false;
+  auto redraw = false;
+  auto input = false;
+  auto quit = false;
+
+  // Only the pane with focus is drawn while it scrolls. The colors of the
+  // others are still on screen unless it's the only one.
+  auto draw_focused_pane = [&]() {
+    if (doc->panes.size() == 1) {
+      begin_color_frame();
+    }
+    size_t y, height;
+    pane_at(doc->focus, y, height);
+    draw_pane(*doc, doc->focus, line_count, display_cols, y, height);
+  };
+
+  // Scrolling is animated a line at a time, unless more keys are waiting
+  auto scroll_core = [&](size_t rows, bool forward) {
+    if (input_pending()) {
+      doc->layout->step(doc->panes[doc->focus], rows, forward);
+      return;
+    }
+    while (rows > 0) {
+      doc->layout->step(doc->panes[doc->focus], 1, forward);
+      draw_focused_pane();
+      refresh();
+      rows--;
+    }
+  };
+
+  auto scroll_forward = [&](size_t n) {
+    doc->forward = true;
+    auto height = pane_height(doc->focus);
+    auto count = doc->layout->count(doc->panes[doc->focus], height + n);
+    scroll_core(count > height ? min(count - height, n) : 0, true);
+  };
+
+  auto scroll_backword = [&](size_t n) {
+    doc->forward = false;
+    auto top = doc->panes[doc->focus];
+    scroll_core(doc->layout->step(top, n, false), false);
+  };
+
+  auto save_position = [&]() {
+    doc->src->save_position(
+        view_position{doc->panes[doc->focus].line, doc->hscroll});
+  };
+
+  auto switch_document = [&](size_t index) {
+    save_position();
+    current_doc = index;
+    if (prefetches[current_doc].valid()) {
+      docs[current_doc] = prefetches[current_doc].get();
+    }
+    doc = &docs[current_doc];
+    doc->last_used = ++use_count;
+    if (!doc->loaded) {
+      load_document(*doc);
+    }
+    evict_documents();
+    prefetch_next();
+    watch_document();
+  };
+
+  // Takes in what the workers have finished: prefetched files, and reloaded
+  // ones
+  auto collect_workers = [&]() {
+    for (size_t i = 0; i < docs.size(); i++) {
+      if (i != current_doc && is_ready(prefetches[i])) {
+        docs[i] = prefetches[i].get();
+        evict_documents();
+        prefetch_next();
+      }
+      auto& d = docs[i];
+      if (is_ready(d.reload_job)) {
+        auto r = d.reload_job.get();
+        if ((r.scanned || r.src) && d.loaded) {
+          update_document(d, move(r), pane_height(d.focus));
+          if (&d == doc) {
+            layout = true;
+          }
+        }
+      }
+    }
+  };
 
+  auto handle_key = [&](int key) {
     switch (key) {
+      case 'q':
+        quit = true;
+        break;
+
       case 's':
         linespace = !linespace;
         layout = true;
         break;
 
+      case 'S':
+        chop = !chop;
+        layout = true;
+        break;
+
+      case 'h':
+      case KEY_LEFT:
+        if (chop) {
+          scroll_horizontally(max(doc->cols / 2, (size_t)1), false);
+          redraw = true;
+        }
+        break;
+
+      case 'l':
+      case KEY_RIGHT:
+        if (chop) {
+          scroll_horizontally(max(doc->cols / 2, (size_t)1), true);
+          redraw = true;
+        }
+        break;
+
       case 'i':
-        if (cols < COLS_ - opt_min_margin * 2) {
-          cols++;
+        if (doc->cols < COLS_ - opt_min_margin * 2) {
+          doc->cols++;
+          doc->fixed_cols = true;
           layout = true;
         }
         break;
 
       case 'o':
-        if (cols > opt_min_margin * 2) {
-          cols -= 2;
+        if (doc->cols > opt_min_margin * 2) {
+          doc->cols -= 2;
+          doc->fixed_cols = true;
           layout = true;
         }
         break;
@@ -514,24 +1059,20 @@ int main(int argc, char* const* argv) {
         break;
 
       case 'j':
-        if (current_line < bottom_line) {
-          current_line++;
-        }
+        scroll_forward(1);
         break;
 
       case 'k':
-        if (current_line > 0) {
-          current_line--;
-        }
+        scroll_backword(1);
         break;
 
       case 'g':
-        current_line = 0;
+        doc->panes[doc->focus] = anchor();
         layout = true;
         break;
 
       case 'G':
-        current_line = bottom_line;
+        doc->panes[doc->focus] = doc->layout->end();
         layout = true;
         break;
 
@@ -552,25 +1093,160 @@ int main(int argc, char* const* argv) {
         scroll_backword(page_lines / 2);
         break;
 
-      case KEY_RESIZE:
-        layout = true;
+      case 'n':
+        if (current_doc + 1 < docs.size()) {
+          switch_document(current_doc + 1);
+          layout = true;
+        }
+        break;
+
+      case 'p':
+        if (current_doc > 0) {
+          switch_document(current_doc - 1);
+          layout = true;
+        }
+        break;
+
+      case 'x': {
+        // The new pane starts where the one with focus is
+        if (doc->panes.size() + 1 <= max_panes(rows)) {
+          auto top = doc->panes[doc->focus];
+          doc->panes.insert(doc->panes.begin() + doc->focus + 1, top);
+          doc->focus++;
+          layout = true;
+        }
+        break;
+      }
+
+      case 'X':
+        if (doc->panes.size() > 1) {
+          doc->panes.erase(doc->panes.begin() + doc->focus);
+          doc->focus = min(doc->focus, doc->panes.size() - 1);
+          layout = true;
+        }
+        break;
+
+      case '\t':
+        if (doc->panes.size() > 1) {
+          doc->focus = (doc->focus + 1) % doc->panes.size();
+          page_lines = min(line_count, pane_height(doc->focus));
+          redraw = true;
+        }
         break;
     }
+  };
+
+  relayout();
+  prefetch_next();
+  watch_document();
+
+  draw(*doc, line_count, display_cols, margin);
+  refresh();
+  idle_pending = true;
+  idle_at = steady_clock::now() + chrono::milliseconds(kIdleDelay);
+
+  // Sleeps until a key, a resize, a change to the file, a finished worker or
+  // a timer, then handles everything that's ready and draws once.
+  while (!quit) {
+    pollfd fds[] = {
+        {fileno(stdin), POLLIN, 0},
+        {signal_pipe[0], POLLIN, 0},
+        {wake_pipe[0], POLLIN, 0},
+        {inotify_fd, POLLIN, 0},
+    };
+    if (poll(fds, 4, poll_timeout()) < 0 && errno != EINTR) break;
+
+    layout = redraw = input = false;
+
+    if (fds[1].revents & POLLIN) {
+      drain(signal_pipe[0]);
+      resize_terminal();
+    }
+    if (fds[2].revents & POLLIN) {
+      drain(wake_pipe[0]);
+      collect_workers();
+    }
+    if ((fds[3].revents & POLLIN) && file_changed() && !doc->reload_pending) {
+      doc->reload_pending = true;
+      doc->reload_at = steady_clock::now() + chrono::milliseconds(kReloadDelay);
+    }
+
+    // ncurses may hold keys it has already read, so this doesn't wait for
+    // the tty to be readable.
+    int key;
+    while (!quit && (key = getch()) != ERR) {
+      if (key == KEY_RESIZE) {
+        schedule_resize();
+        continue;
+      }
+      cancel_prefetch(*doc);
+      input = true;
+      handle_key(key);
+    }
+    if (quit) break;
+
+    auto now = steady_clock::now();
+    if (resize_pending && now >= resize_at) {
+      resize_pending = false;
+      layout = true;
+    }
+
+    // Writes keep coming while a file grows, so reloads are spaced out, and
+    // only one runs at a time.
+    if (doc->reload_pending && now >= doc->reload_at) {
+      if (doc->reload_job.valid()) {
+        doc->reload_at = now + chrono::milliseconds(kReloadDelay);
+      } else {
+        reload_document(*doc);
+      }
+    }
 
     if (layout) {
-      display_lines = fold_lines(lines, cols, linespace, opt_word_wrap);
-      display_cols = min(max_cols, min(cols, COLS_));
-      margin = calc_margin(rows, opt_min_margin, display_lines.size());
-      rows = ROWS_ - margin * 2;  // adjust based on actual margin
-      page_lines = calc_page_lines(display_lines.size(), rows, bottom_line);
-      if (current_line > bottom_line) {
-        current_line = bottom_line;
+      relayout();
+    }
+
+    if (layout || redraw) {
+      erase();
+      draw(*doc, line_count, display_cols, margin);
+    } else if (input) {
+      draw_focused_pane();
+    }
+    if (layout || redraw || input) {
+      refresh();
+      idle_pending = true;
+      idle_at = now + chrono::milliseconds(kIdleDelay);
+    }
+
+    // Nothing has happened for a while, so get the pages around the view
+    // ready. Any key stops that.
+    if (idle_pending && !resize_pending && now >= idle_at) {
+      idle_pending = false;
+      if (!chop) {
+        prefetch_pages(*doc, pane_height(doc->focus));
       }
     }
+  }
+
+  doc->src->save_position(
+      view_position{doc->panes[doc->focus].line, doc->hscroll});
 
-    erase();
-    draw(display_lines, display_cols, current_line, margin);
-    refresh();
+  // Stop the work in the background, and wait for the worker threads, which
+  // may hold documents being prefetched, before ncurses is torn down
+  *prefetches_cancelled = true;
+  for (auto& d : docs) {
+    cancel_prefetch(d);
+    if (d.layout) {
+      d.layout->cancel();
+    }
+  }
+  join_workers();
+  for (auto& f : prefetches) {
+    if (f.valid()) {
+      auto d = f.get();
+      if (d.layout) {
+        d.layout->cancel();
+      }
+    }
   }
 
   endwin();
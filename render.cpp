@@ -0,0 +1,202 @@
+#include "render.h"
+
+#include <poll.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "encoding.h"
+
+using namespace std;
+
+static const size_t kReadBytes = 1024 * 1024;
+
+static const char kSpaces[] =
+    "                                                                ";
+
+renderer::renderer(FILE* out, const layout_options& opts, size_t page_cols)
+    : out_(out), opts_(opts), buffer_(kReadBytes) {
+  pad_ = page_cols > opts_.cols ? page_cols / 2 - opts_.cols / 2 : 0;
+  // Output goes out in large writes rather than a line at a time
+  setvbuf(out_, nullptr, _IOFBF, kReadBytes);
+}
+
+// Renders everything read from `fd`. Returns false on a read error.
+bool renderer::render(int fd) {
+  decoder in(fd);
+  size_t len = 0;
+  while (true) {
+    auto n = in.read(buffer_.data() + len, buffer_.size() - len);
+    if (n < 0) {
+      return false;
+    }
+    len += n;
+    auto data = buffer_.data();
+
+    size_t pos = 0;
+    while (auto nl = static_cast<const char*>(
+               memchr(data + pos, '\n', len - pos))) {
+      render_line(string_view(data + pos, nl - (data + pos)), false);
+      pos = nl - data + 1;
+    }
+
+    // Output is flushed whenever the input has to be waited for, so that a
+    // stream still being written shows up as it comes
+    pollfd p = {fd, POLLIN, 0};
+    if (poll(&p, 1, 0) == 0) {
+      fflush(out_);
+    }
+
+    if (n == 0) {
+      if (pos < len) {
+        render_line(string_view(data + pos, len - pos), false);
+      }
+      return true;
+    }
+
+    if (pos == 0 && len == buffer_.size()) {
+      // A line longer than the buffer is laid out a segment at a time
+      string_view line(data, len);
+      auto cut = segment_start(line, len - 1);
+      render_line(line.substr(0, cut > 0 ? cut : len), true);
+      pos = cut > 0 ? cut : len;
+    }
+    memmove(data, data + pos, len - pos);
+    len -= pos;
+  }
+}
+
+// Renders a source line, or the rest of one when `continued` is set
+void renderer::render_line(string_view line, bool continued) {
+  auto first_part = !continuing_;
+  continuing_ = continued;
+
+  if (first_part) {
+    st_ = style();
+    if (opts_.linespace) {
+      if (line.empty()) return;
+      if (!first_text_line_) {
+        fputc('\n', out_);
+      }
+    }
+    first_text_line_ = false;
+  }
+
+  if (opts_.chop) {
+    if (first_part) {
+      render_chopped(line);
+    }
+    return;
+  }
+
+  fold_line(line, opts_.cols, opts_.word_warp, spans_);
+  for (auto& span : spans_) {
+    render_row(line, span.offset, span.offset + span.length);
+  }
+}
+
+void renderer::render_row(string_view line, size_t pos, size_t end) {
+  for (auto n = pad_; n > 0;) {
+    auto len = min(n, sizeof(kSpaces) - 1);
+    fwrite(kSpaces, 1, len, out_);
+    n -= len;
+  }
+  while (pos < end) {
+    imm_glyph glyph;
+    size_t col_len = 0;
+    pos = next_glyph(line, pos, st_, glyph, col_len);
+    write_glyph(line, glyph);
+  }
+  flush_run(line);
+  end_row();
+}
+
+// Renders the columns of a line that fit in the view, like chop mode does
+// when it isn't scrolled
+void renderer::render_chopped(string_view line) {
+  size_t pos = 0;
+  size_t col = 0;
+  size_t end = 0;
+  style st;
+  while (pos < line.size()) {
+    imm_glyph glyph;
+    size_t col_len = 0;
+    auto next = next_glyph(line, pos, st, glyph, col_len);
+    if (col + col_len > opts_.cols) break;
+    col += col_len;
+    pos = end = next;
+  }
+  render_row(line, 0, end);
+}
+
+// Adds a glyph to the run of bytes to write. A run is written out when the
+// style changes or bytes that aren't shown, such as escape sequences, come
+// in between.
+void renderer::write_glyph(string_view line, const imm_glyph& glyph) {
+  if (glyph.length == 0) {
+    return;
+  }
+  auto same = glyph.attrs == written_.attrs && glyph.fg == written_.fg &&
+              glyph.bg == written_.bg;
+  if (!same || glyph.offset != run_end_) {
+    flush_run(line);
+    if (!same) {
+      write_style(glyph);
+    }
+    run_begin_ = glyph.offset;
+  }
+  run_end_ = glyph.offset + glyph.length;
+}
+
+void renderer::flush_run(string_view line) {
+  if (run_end_ > run_begin_) {
+    fwrite(line.data() + run_begin_, 1, run_end_ - run_begin_, out_);
+  }
+  run_begin_ = run_end_ = 0;
+}
+
+static void write_color(FILE* out, int color, int base, int bright_base) {
+  if (color & IMM_COLOR_RGB) {
+    fprintf(out, ";%d;2;%d;%d;%d", base + 8, color >> 16 & 0xff,
+            color >> 8 & 0xff, color & 0xff);
+  } else if (color < 8) {
+    fprintf(out, ";%d", base + color);
+  } else if (color < 16) {
+    fprintf(out, ";%d", bright_base + color - 8);
+  } else {
+    fprintf(out, ";%d;5;%d", base + 8, color);
+  }
+}
+
+void renderer::write_style(const imm_glyph& glyph) {
+  static const pair<unsigned int, int> kAttrs[] = {
+      {IMM_ATTR_BOLD, 1},    {IMM_ATTR_DIM, 2},       {IMM_ATTR_ITALIC, 3},
+      {IMM_ATTR_UNDERLINE, 4}, {IMM_ATTR_BLINK, 5},   {IMM_ATTR_REVERSE, 7},
+      {IMM_ATTR_INVISIBLE, 8}, {IMM_ATTR_STRIKE, 9},
+  };
+  fputs("\x1b[0", out_);
+  for (auto [attr, code] : kAttrs) {
+    if (glyph.attrs & attr) {
+      fprintf(out_, ";%d", code);
+    }
+  }
+  if (glyph.fg != IMM_COLOR_DEFAULT) {
+    write_color(out_, glyph.fg, 30, 90);
+  }
+  if (glyph.bg != IMM_COLOR_DEFAULT) {
+    write_color(out_, glyph.bg, 40, 100);
+  }
+  fputc('m', out_);
+  written_ = glyph;
+}
+
+// Resets the style at the end of a row, so the margin of the next one isn't
+// painted
+void renderer::end_row() {
+  if (written_.attrs != 0 || written_.fg != IMM_COLOR_DEFAULT ||
+      written_.bg != IMM_COLOR_DEFAULT) {
+    fputs("\x1b[m", out_);
+    written_ = imm_glyph{0, 0, 0, IMM_COLOR_DEFAULT, IMM_COLOR_DEFAULT};
+  }
+  fputc('\n', out_);
+}
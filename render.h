@@ -0,0 +1,45 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+#include <stdio.h>
+
+#include <string_view>
+#include <vector>
+
+#include "layout.h"
+#include "view.h"
+
+// Lays out text as it's read and writes the display lines to a stream,
+// centered in `page_cols` columns with their attributes as SGR sequences.
+// Only the line being laid out is kept in memory, and nothing is allocated
+// per line once the buffers have grown.
+class renderer {
+ public:
+  renderer(FILE* out, const layout_options& opts, size_t page_cols);
+
+  bool render(int fd);
+
+ private:
+  void render_line(std::string_view line, bool continued);
+  void render_row(std::string_view line, size_t pos, size_t end);
+  void render_chopped(std::string_view line);
+  void write_glyph(std::string_view line, const imm_glyph& glyph);
+  void flush_run(std::string_view line);
+  void write_style(const imm_glyph& glyph);
+  void end_row();
+
+  FILE* out_;
+  layout_options opts_;
+  size_t pad_ = 0;
+  bool first_text_line_ = true;
+  bool continuing_ = false;
+
+  std::vector<char> buffer_;
+  std::vector<imm_span> spans_;
+  style st_;
+  imm_glyph written_ = imm_glyph{0, 0, 0, IMM_COLOR_DEFAULT, IMM_COLOR_DEFAULT};
+  size_t run_begin_ = 0;
+  size_t run_end_ = 0;
+};
+
+#endif /* RENDER_H */
@@ -0,0 +1,810 @@
+#include "source.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <future>
+#include <thread>
+#include <utility>
+
+#include "encoding.h"
+#include "layout.h"
+
+using namespace std;
+
+static const size_t kIndexChunkBytes = 4 * 1024 * 1024;
+static const size_t kCancelCheckLines = 4096;
+static const size_t kMapSpareBytes = 64 * 1024 * 1024;
+static const off_t kCacheBudget = 256 * 1024 * 1024;
+static const time_t kCacheMaxAge = 90 * 24 * 60 * 60;  // s
+
+static const size_t kCacheSpareLines = 4096;
+
+static const char kCacheMagic[8] = {'I', 'M', 'M', 'I', 'D', 'X', '0', '3'};
+
+// Layout of a cache file: the header, the path of the indexed file padded to
+// 8 bytes, then room for `capacity + 1` offsets and `capacity` widths, of
+// which the first `line_count + 1` and `line_count` are used. Lines appended
+// to the file go into the room left, before the header is updated.
+struct cache_header {
+  char magic[8];
+  uint64_t dev;
+  uint64_t ino;
+  uint64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  uint64_t tail_hash;
+  uint64_t encoding;
+  uint64_t line_count;
+  uint64_t capacity;
+  uint64_t max_cols;
+  uint64_t position_line;
+  uint64_t position_hscroll;
+  uint64_t path_len;
+};
+
+static uint64_t fnv1a(const char* data, size_t len) {
+  uint64_t hash = 0xcbf29ce484222325;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= static_cast<unsigned char>(data[i]);
+    hash *= 0x100000001b3;
+  }
+  return hash;
+}
+
+// Hash of the last bytes before `size`, which tells whether a file that got
+// larger was appended to or rewritten.
+static uint64_t tail_hash(const char* data, size_t size) {
+  auto len = min(size, (size_t)4096);
+  return fnv1a(data + size - len, len);
+}
+
+static void mtime(const struct stat& st, int64_t& sec, int64_t& nsec) {
+#ifdef __APPLE__
+  sec = st.st_mtimespec.tv_sec;
+  nsec = st.st_mtimespec.tv_nsec;
+#else
+  sec = st.st_mtim.tv_sec;
+  nsec = st.st_mtim.tv_nsec;
+#endif
+}
+
+static size_t align8(size_t n) { return (n + 7) & ~(size_t)7; }
+
+static size_t offsets_pos(const cache_header& h) {
+  return align8(sizeof(cache_header) + h.path_len);
+}
+
+static size_t widths_pos(const cache_header& h) {
+  return offsets_pos(h) + (h.capacity + 1) * sizeof(uint64_t);
+}
+
+static string cache_dir() {
+  auto xdg = getenv("XDG_CACHE_HOME");
+  if (xdg && *xdg) {
+    return string(xdg) + "/immersion";
+  }
+  auto home = getenv("HOME");
+  if (home && *home) {
+    return string(home) + "/.cache/immersion";
+  }
+  return string();
+}
+
+static string cache_file_path(const string& real_path) {
+  auto dir = cache_dir();
+  if (dir.empty() || real_path.empty()) {
+    return string();
+  }
+  char name[32];
+  snprintf(name, sizeof(name), "/%016llx.idx",
+           (unsigned long long)fnv1a(real_path.data(), real_path.size()));
+  return dir + name;
+}
+
+// Caches hold the paths of the files opened, so only the user may read them
+static void make_dirs(const string& dir) {
+  for (size_t pos = 1; pos != string::npos; pos = dir.find('/', pos + 1)) {
+    mkdir(dir.substr(0, pos).c_str(), 0700);
+  }
+  mkdir(dir.c_str(), 0700);
+}
+
+// Removes the caches that haven't been used for kCacheMaxAge, then the ones
+// used least recently while the directory holds more than kCacheBudget. The
+// position in a file is saved to its cache when leaving it, so the mtime of
+// a cache tells when it was last used. `keep` is the cache just written.
+static void prune_caches(const string& keep) {
+  auto dir = keep.substr(0, keep.rfind('/'));
+  auto d = opendir(dir.c_str());
+  if (!d) {
+    return;
+  }
+  vector<pair<time_t, string>> caches;
+  off_t total = 0;
+  auto now = time(nullptr);
+  while (auto e = readdir(d)) {
+    struct stat st;
+    auto path = dir + "/" + e->d_name;
+    if (!strstr(e->d_name, ".idx") || stat(path.c_str(), &st) != 0 ||
+        !S_ISREG(st.st_mode)) {
+      continue;
+    }
+    if (path != keep && now - st.st_mtime > kCacheMaxAge) {
+      unlink(path.c_str());
+      continue;
+    }
+    total += st.st_blocks * 512;
+    if (path != keep) {
+      caches.emplace_back(st.st_mtime, path);
+    }
+  }
+  closedir(d);
+
+  sort(caches.begin(), caches.end());
+  for (size_t i = 0; i < caches.size() && total > kCacheBudget; i++) {
+    struct stat st;
+    if (stat(caches[i].second.c_str(), &st) == 0 &&
+        unlink(caches[i].second.c_str()) == 0) {
+      total -= st.st_blocks * 512;
+    }
+  }
+}
+
+source::source(source&& other) noexcept { *this = move(other); }
+
+source& source::operator=(source&& other) noexcept {
+  if (this != &other) {
+    close();
+    data_ = exchange(other.data_, nullptr);
+    size_ = exchange(other.size_, 0);
+    map_ = exchange(other.map_, nullptr);
+    map_size_ = exchange(other.map_size_, 0);
+    buffer_ = move(other.buffer_);
+    enc_ = exchange(other.enc_, encoding::utf8);
+    decode_lines_ = exchange(other.decode_lines_, false);
+    decoded_ = move(other.decoded_);
+    line_count_ = exchange(other.line_count_, 0);
+    max_cols_ = exchange(other.max_cols_, 0);
+    offsets_ = move(other.offsets_);
+    widths_ = move(other.widths_);
+    cached_offsets_ = exchange(other.cached_offsets_, nullptr);
+    cached_widths_ = exchange(other.cached_widths_, nullptr);
+    cache_map_ = exchange(other.cache_map_, nullptr);
+    cache_map_size_ = exchange(other.cache_map_size_, 0);
+    cache_fd_ = exchange(other.cache_fd_, -1);
+    path_ = move(other.path_);
+    cache_path_ = move(other.cache_path_);
+    position_ = other.position_;
+    st_ = other.st_;
+    tail_hash_ = other.tail_hash_;
+  }
+  return *this;
+}
+
+source::~source() { close(); }
+
+bool source::open(const string& path, const atomic<bool>* cancelled) {
+  close();
+
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+    // Pipes and devices can't be mapped or cached
+    read(fd);
+    ::close(fd);
+    return true;
+  }
+
+  // The mapping reaches past the end of the file, so that what's appended
+  // to it can be read in place
+  size_ = st.st_size;
+  if (size_ > 0) {
+    map_size_ = size_ + max(size_ / 2, kMapSpareBytes);
+    map_ = mmap(nullptr, map_size_, PROT_READ, MAP_SHARED, fd, 0);
+    if (map_ == MAP_FAILED) {
+      map_size_ = size_;
+      map_ = mmap(nullptr, map_size_, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    if (map_ == MAP_FAILED) {
+      map_ = nullptr;
+      map_size_ = 0;
+      size_ = 0;
+      read(fd);
+      ::close(fd);
+      return true;
+    }
+    data_ = static_cast<const char*>(map_);
+    decode();
+  }
+  ::close(fd);
+  st_ = st;
+  tail_hash_ = tail_hash(data_, size_);
+
+  char real[PATH_MAX];
+  path_ = realpath(path.c_str(), real) ? real : "";
+  cache_path_ = cache_file_path(path_);
+  if (!load_cache(st, cancelled) && index(0, cancelled)) {
+    save_cache(st);
+  }
+  if (cancelled && *cancelled) {
+    close();
+    return false;
+  }
+  return true;
+}
+
+void source::read(int fd) {
+  decoder in(fd);
+  vector<char> buffer;
+  char buf[65536];
+  ssize_t n;
+  while ((n = in.read(buf, sizeof(buf))) > 0) {
+    buffer.insert(buffer.end(), buf, buf + n);
+  }
+  assign(move(buffer));
+}
+
+void source::assign(vector<char> buffer) {
+  close();
+  buffer_ = move(buffer);
+  data_ = buffer_.data();
+  size_ = buffer_.size();
+  index(0);
+}
+
+void source::close() {
+  if (map_) {
+    munmap(map_, map_size_);
+  }
+  unmap_cache();
+  data_ = nullptr;
+  size_ = 0;
+  map_ = nullptr;
+  map_size_ = 0;
+  vector<char>().swap(buffer_);
+  enc_ = encoding::utf8;
+  decode_lines_ = false;
+  decoded_.clear();
+  line_count_ = 0;
+  max_cols_ = 0;
+  vector<uint64_t>().swap(offsets_);
+  vector<uint32_t>().swap(widths_);
+  path_.clear();
+  cache_path_.clear();
+  position_ = view_position();
+  st_ = {};
+  tail_hash_ = 0;
+}
+
+size_t source::memory_usage() const {
+  auto size = buffer_.capacity() + offsets_.capacity() * sizeof(uint64_t) +
+              widths_.capacity() * sizeof(uint32_t);
+  lock_guard<mutex> lock(decode_mutex_);
+  for (auto& blk : decoded_) {
+    if (blk) {
+      size += sizeof(*blk) + blk->lines.capacity() * sizeof(string_view);
+      for (auto& text : blk->texts) {
+        size += sizeof(text) + text.capacity();
+      }
+    }
+  }
+  return size;
+}
+
+// Lines in ASCII are used in place. The others are converted with the rest
+// of their block the first time one of them is used, and kept. Lines added
+// to the last block later are converted into a piece of their own, as the
+// lines handed out point into the earlier ones.
+string_view source::decoded_line(size_t i) const {
+  auto raw = raw_line(i);
+  if (ascii_end(raw.data(), 0, raw.size()) == raw.size()) {
+    return raw;
+  }
+  lock_guard<mutex> lock(decode_mutex_);
+  auto index = i / kDecodeLines;
+  if (decoded_.size() <= index) {
+    decoded_.resize(index + 1);
+  }
+  auto& blk = decoded_[index];
+  if (!blk) {
+    blk = make_unique<decoded_block>();
+  }
+  if (blk->lines.size() <= i % kDecodeLines) {
+    transcoder t(enc_);
+    auto begin = index * kDecodeLines + blk->lines.size();
+    auto end = min(index * kDecodeLines + kDecodeLines, line_count_);
+    vector<char> text;
+    vector<pair<size_t, size_t>> spans;
+    for (auto j = begin; j < end; j++) {
+      auto line = raw_line(j);
+      auto pos = text.size();
+      if (ascii_end(line.data(), 0, line.size()) < line.size()) {
+        t.convert(line.data(), line.size(), true, text);
+      }
+      spans.emplace_back(pos, text.size() - pos);
+    }
+    blk->texts.push_back(move(text));
+    auto& piece = blk->texts.back();
+    for (size_t j = 0; j < spans.size(); j++) {
+      auto line = raw_line(begin + j);
+      blk->lines.push_back(
+          spans[j].second > 0 || line.empty()
+              ? string_view(piece.data() + spans[j].first, spans[j].second)
+              : line);
+    }
+  }
+  return blk->lines[i % kDecodeLines];
+}
+
+// Detects the encoding of a mapped file. UTF-8 stays mapped, past its byte
+// order mark if it has one. So do Shift_JIS and EUC-JP, where a newline is
+// never part of another character, so their lines are found in place and
+// only converted when they're used. UTF-16 is converted as a whole.
+void source::decode() {
+  size_t bom_len;
+  enc_ = detect_encoding(data_, size_, bom_len);
+  if (enc_ == encoding::utf8) {
+    data_ += bom_len;
+    size_ -= bom_len;
+    return;
+  }
+  if (enc_ == encoding::shift_jis || enc_ == encoding::euc_jp) {
+    decode_lines_ = true;
+    return;
+  }
+  transcoder t(enc_);
+  buffer_.reserve(size_ + size_ / 2);
+  t.convert(data_ + bom_len, size_ - bom_len, true, buffer_);
+  munmap(map_, map_size_);
+  map_ = nullptr;
+  map_size_ = 0;
+  data_ = buffer_.data();
+  size_ = buffer_.size();
+}
+
+// Offsets and widths of the lines in [begin, end), which ends after a newline
+// or at the end of the text
+struct line_index {
+  vector<uint64_t> offsets;
+  vector<uint32_t> widths;
+  size_t max_cols = 0;
+  size_t next = 0;  // offset the line after the last one would start at
+};
+
+// Lines that aren't ASCII are measured in UTF-8, converted from `enc`. It
+// stops early once `cancelled` is set.
+static line_index index_lines(const char* data, size_t begin, size_t end,
+                              encoding enc, const atomic<bool>* cancelled) {
+  line_index result;
+  unique_ptr<transcoder> t;
+  if (enc != encoding::utf8) {
+    t = make_unique<transcoder>(enc);
+  }
+  vector<char> converted;
+  auto pos = begin;
+  while (pos < end) {
+    if (cancelled && result.offsets.size() % kCancelCheckLines == 0 &&
+        *cancelled) {
+      break;
+    }
+    auto nl = static_cast<const char*>(memchr(data + pos, '\n', end - pos));
+    size_t line_end = nl ? nl - data : end;
+    string_view line(data + pos, line_end - pos);
+    if (t && ascii_end(line.data(), 0, line.size()) < line.size()) {
+      converted.clear();
+      t->convert(line.data(), line.size(), true, converted);
+      line = string_view(converted.data(), converted.size());
+    }
+    // Huge lines aren't scanned. Their length bounds their width, which
+    // only sizes the view and limits scrolling.
+    auto width = line_end - pos > kSegmentBytes ? line_end - pos
+                                                : columns(line);
+    result.offsets.push_back(pos);
+    result.widths.push_back(
+        static_cast<uint32_t>(min(width, (size_t)UINT32_MAX)));
+    result.max_cols = max(result.max_cols, width);
+    pos = line_end + 1;
+  }
+  result.next = pos;
+  return result;
+}
+
+// Indexes the lines from `from`, which is the start of a line. `offsets_`
+// holds the starts of the lines before it. The text is split at newlines
+// into a chunk per core, which are indexed in parallel and then joined.
+// Returns false if it was cancelled, leaving the index incomplete.
+bool source::index(size_t from, const atomic<bool>* cancelled) {
+  auto enc = decode_lines_ ? enc_ : encoding::utf8;
+  size_t threads = max(thread::hardware_concurrency(), 1u);
+  auto chunk = max(kIndexChunkBytes, (size_ - min(from, size_)) / threads + 1);
+  vector<size_t> bounds{from};
+  do {
+    auto pos = bounds.back() + chunk;
+    auto nl = pos < size_ ? memchr(data_ + pos, '\n', size_ - pos) : nullptr;
+    bounds.push_back(nl ? static_cast<const char*>(nl) - data_ + 1 : size_);
+  } while (bounds.back() < size_);
+
+  vector<future<line_index>> jobs;
+  for (size_t i = 1; i + 1 < bounds.size(); i++) {
+    jobs.push_back(async(launch::async, index_lines, data_, bounds[i],
+                         bounds[i + 1], enc, cancelled));
+  }
+  vector<line_index> chunks;
+  chunks.push_back(index_lines(data_, bounds[0], bounds[1], enc, cancelled));
+  for (auto& job : jobs) {
+    chunks.push_back(job.get());
+  }
+  if (cancelled && *cancelled) {
+    return false;
+  }
+  size_t lines = 0;
+  for (auto& c : chunks) {
+    lines += c.widths.size();
+  }
+  offsets_.reserve(offsets_.size() + lines + 1);
+  widths_.reserve(widths_.size() + lines);
+  for (auto& c : chunks) {
+    offsets_.insert(offsets_.end(), c.offsets.begin(), c.offsets.end());
+    widths_.insert(widths_.end(), c.widths.begin(), c.widths.end());
+    max_cols_ = max(max_cols_, c.max_cols);
+  }
+  offsets_.push_back(chunks.back().next);
+  line_count_ = widths_.size();
+  return true;
+}
+
+// Maps the cache file, and points the index at it. Only its layout is
+// checked here. It's kept open for adding lines to it.
+const cache_header* source::map_cache() {
+  int fd = ::open(cache_path_.c_str(), O_RDWR);
+  if (fd < 0) {
+    return nullptr;
+  }
+  struct stat cache_st;
+  if (fstat(fd, &cache_st) < 0 ||
+      (size_t)cache_st.st_size < sizeof(cache_header)) {
+    ::close(fd);
+    return nullptr;
+  }
+  auto map = mmap(nullptr, cache_st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    ::close(fd);
+    return nullptr;
+  }
+  cache_fd_ = fd;
+  cache_map_ = map;
+  cache_map_size_ = cache_st.st_size;
+
+  auto base = static_cast<const char*>(map);
+  auto h = static_cast<const cache_header*>(map);
+  auto valid =
+      memcmp(h->magic, kCacheMagic, sizeof(kCacheMagic)) == 0 &&
+      h->path_len < cache_map_size_ && h->capacity < cache_map_size_ &&
+      h->line_count <= h->capacity &&
+      widths_pos(*h) + h->capacity * sizeof(uint32_t) <= cache_map_size_ &&
+      string_view(base + sizeof(cache_header), h->path_len) == path_;
+  if (!valid) {
+    unmap_cache();
+    return nullptr;
+  }
+  cached_offsets_ = reinterpret_cast<const uint64_t*>(base + offsets_pos(*h));
+  cached_widths_ = reinterpret_cast<const uint32_t*>(base + widths_pos(*h));
+  return h;
+}
+
+bool source::load_cache(const struct stat& st,
+                        const atomic<bool>* cancelled) {
+  if (cache_path_.empty()) {
+    return false;
+  }
+  auto h = map_cache();
+  if (!h) {
+    return false;
+  }
+  int64_t sec, nsec;
+  mtime(st, sec, nsec);
+  auto valid =
+      h->dev == (uint64_t)st.st_dev && h->ino == (uint64_t)st.st_ino &&
+      h->encoding == (uint64_t)enc_ &&
+      (h->size == size_ ? h->mtime_sec == sec && h->mtime_nsec == nsec
+                        : h->size < size_ &&
+                              tail_hash(data_, h->size) == h->tail_hash);
+  if (!valid) {
+    unmap_cache();
+    return false;
+  }
+
+  line_count_ = h->line_count;
+  max_cols_ = h->max_cols;
+  position_ = view_position{h->position_line, h->position_hscroll};
+  if (h->size == size_) {
+    return true;
+  }
+
+  // Appended since. When the cached lines all ended with a newline, only the
+  // new ones are indexed, and added to the cache if it has room for them.
+  auto lines = line_count_;
+  if (cached_offsets_[lines] == h->size) {
+    if (!index(h->size, cancelled)) {
+      return true;
+    }
+    line_count_ = lines + widths_.size();
+    if (line_count_ <= h->capacity &&
+        append_cache(st, size_, lines, offsets_, widths_, max_cols_)) {
+      vector<uint64_t>().swap(offsets_);
+      vector<uint32_t>().swap(widths_);
+      return true;
+    }
+    offsets_.insert(offsets_.begin(), cached_offsets_,
+                    cached_offsets_ + lines);
+    widths_.insert(widths_.begin(), cached_widths_, cached_widths_ + lines);
+    unmap_cache();
+    save_cache(st);
+    return true;
+  }
+
+  // Otherwise the last line may have been completed, so the index is taken
+  // over and rescanned from there, and the cache is written anew.
+  offsets_.assign(cached_offsets_, cached_offsets_ + lines);
+  widths_.assign(cached_widths_, cached_widths_ + lines);
+  unmap_cache();
+  size_t from = 0;
+  if (!offsets_.empty()) {
+    from = offsets_.back();
+    offsets_.pop_back();
+    widths_.pop_back();
+  }
+  if (index(from, cancelled)) {
+    save_cache(st);
+  }
+  return true;
+}
+
+// Writes the index to the cache file, leaving room to add lines to it, and
+// then maps it in place of the index held in memory.
+void source::save_cache(const struct stat& st) {
+  if (!write_cache(st, size_, line_count_,
+                   vector<uint64_t>{offsets()[line_count_]}, {},
+                   max_cols_)) {
+    return;
+  }
+  prune_caches(cache_path_);
+
+  if (!cached()) {
+    auto mapped = map_cache();
+    if (mapped && mapped->line_count == line_count_ &&
+        mapped->size == size_) {
+      vector<uint64_t>().swap(offsets_);
+      vector<uint32_t>().swap(widths_);
+    } else {
+      unmap_cache();
+    }
+  }
+}
+
+// Writes a cache file for a file of `size` bytes, with the first `lines`
+// lines of the index followed by the given ones, as in append_cache().
+bool source::write_cache(const struct stat& st, size_t size, size_t lines,
+                         const vector<uint64_t>& offsets,
+                         const vector<uint32_t>& widths,
+                         size_t max_cols) const {
+  if (cache_path_.empty()) {
+    return false;
+  }
+  make_dirs(cache_path_.substr(0, cache_path_.rfind('/')));
+
+  auto line_count = lines + widths.size();
+  cache_header h = {};
+  memcpy(h.magic, kCacheMagic, sizeof(kCacheMagic));
+  h.dev = st.st_dev;
+  h.ino = st.st_ino;
+  h.size = size;
+  mtime(st, h.mtime_sec, h.mtime_nsec);
+  h.tail_hash = tail_hash(data_, size);
+  h.encoding = (uint64_t)enc_;
+  h.line_count = line_count;
+  h.capacity = line_count + line_count / 2 + kCacheSpareLines;
+  h.max_cols = max_cols;
+  h.position_line = position_.line;
+  h.position_hscroll = position_.hscroll;
+  h.path_len = path_.size();
+
+  // Written aside and renamed, so that readers never map a partial file. The
+  // room left is a hole in the file, taking no space on disk.
+  auto tmp_path = cache_path_ + "." + to_string(getpid());
+  int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  auto fp = fd >= 0 ? fdopen(fd, "wb") : nullptr;
+  if (!fp) {
+    if (fd >= 0) {
+      ::close(fd);
+    }
+    return false;
+  }
+  char pad[8] = {};
+  auto pad_len = offsets_pos(h) - sizeof(h) - path_.size();
+  auto end = widths_pos(h) + h.capacity * sizeof(uint32_t);
+  auto ok =
+      fwrite(&h, sizeof(h), 1, fp) == 1 &&
+      fwrite(path_.data(), 1, path_.size(), fp) == path_.size() &&
+      fwrite(pad, 1, pad_len, fp) == pad_len &&
+      fwrite(this->offsets(), sizeof(uint64_t), lines, fp) == lines &&
+      fwrite(offsets.data(), sizeof(uint64_t), offsets.size(), fp) ==
+          offsets.size() &&
+      fseeko(fp, widths_pos(h), SEEK_SET) == 0 &&
+      fwrite(this->widths(), sizeof(uint32_t), lines, fp) == lines &&
+      fwrite(widths.data(), sizeof(uint32_t), widths.size(), fp) ==
+          widths.size() &&
+      fflush(fp) == 0 && ftruncate(fd, end) == 0;
+  ok = fclose(fp) == 0 && ok;
+  if (!ok || rename(tmp_path.c_str(), cache_path_.c_str()) < 0) {
+    unlink(tmp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+// Adds lines to the mapped cache after the first `lines`: their offsets,
+// ending with where the next line would start, and their widths. The header
+// is updated last, for a file of `size` bytes. Those using the cache only
+// read as many lines as they know of, and the entries they read don't
+// change.
+bool source::append_cache(const struct stat& st, size_t size, size_t lines,
+                          const vector<uint64_t>& offsets,
+                          const vector<uint32_t>& widths,
+                          size_t max_cols) const {
+  auto h = *static_cast<const cache_header*>(cache_map_);
+  ssize_t offsets_len = offsets.size() * sizeof(uint64_t);
+  ssize_t widths_len = widths.size() * sizeof(uint32_t);
+  if (pwrite(cache_fd_, offsets.data(), offsets_len,
+             offsets_pos(h) + lines * sizeof(uint64_t)) != offsets_len ||
+      pwrite(cache_fd_, widths.data(), widths_len,
+             widths_pos(h) + lines * sizeof(uint32_t)) != widths_len) {
+    return false;
+  }
+  h.size = size;
+  mtime(st, h.mtime_sec, h.mtime_nsec);
+  h.tail_hash = tail_hash(data_, size);
+  h.line_count = lines + widths.size();
+  h.max_cols = max_cols;
+  return pwrite(cache_fd_, &h, sizeof(h), 0) == sizeof(h);
+}
+
+// Finds the lines appended to the file since it was indexed and adds them to
+// the cache, reading the text past the end in place. Nothing in the source
+// changes, so it can run on a worker while the source is used, and append()
+// takes the lines in after. Returns false if the file changed otherwise, so
+// it has to be opened again.
+bool source::scan_appended(appended_lines& result) const {
+  struct stat st;
+  if (!map_ || !cached() || stat(path_.c_str(), &st) != 0 ||
+      st.st_dev != st_.st_dev || st.st_ino != st_.st_ino) {
+    return false;
+  }
+  int64_t sec, nsec, old_sec, old_nsec;
+  mtime(st, sec, nsec);
+  mtime(st_, old_sec, old_nsec);
+  auto bom_len = data_ - static_cast<const char*>(map_);
+  result.st = st;
+  result.size = st.st_size - min((off_t)bom_len, st.st_size);
+  result.first = line_count_;
+  result.max_cols = max_cols_;
+  if (result.size == size_) {
+    return sec == old_sec && nsec == old_nsec;
+  }
+  if (result.size < size_ || bom_len + result.size > map_size_ ||
+      tail_hash(data_, size_) != tail_hash_) {
+    return false;
+  }
+
+  // A last line without a newline may go on, so it's indexed again
+  auto from = size_;
+  if (offsets()[line_count_] != size_) {
+    result.first = line_count_ - 1;
+    from = offsets()[result.first];
+  }
+  auto lines = index_lines(data_, from, result.size,
+                           decode_lines_ ? enc_ : encoding::utf8, nullptr);
+  result.offsets = move(lines.offsets);
+  result.offsets.push_back(lines.next);
+  result.widths = move(lines.widths);
+  result.max_cols = max(max_cols_, lines.max_cols);
+
+  // The entries in the cache stay as they are while the source uses them, so
+  // replacing the last line, or running out of room, takes a new cache file
+  auto h = static_cast<const cache_header*>(cache_map_);
+  if (result.first == line_count_ &&
+      line_count_ + result.widths.size() <= h->capacity) {
+    return append_cache(st, result.size, line_count_, result.offsets,
+                        result.widths, result.max_cols);
+  }
+  result.rewritten = true;
+  return write_cache(st, result.size, result.first, result.offsets,
+                     result.widths, result.max_cols);
+}
+
+// Takes in the lines found by scan_appended(). Nothing may be reading the
+// source meanwhile. A last line indexed again is converted again when it's
+// used, and the lines handed out before stay valid.
+void source::append(const appended_lines& lines) {
+  if (lines.rewritten) {
+    // The old cache stays mapped until the new one is, or the index is held
+    // in memory if it can't be
+    auto old_map = exchange(cache_map_, nullptr);
+    auto old_map_size = exchange(cache_map_size_, 0);
+    auto old_fd = exchange(cache_fd_, -1);
+    auto old_offsets = exchange(cached_offsets_, nullptr);
+    auto old_widths = exchange(cached_widths_, nullptr);
+    auto h = map_cache();
+    if (!h || h->size != lines.size ||
+        h->line_count != lines.first + lines.widths.size()) {
+      unmap_cache();
+      offsets_.assign(old_offsets, old_offsets + lines.first);
+      offsets_.insert(offsets_.end(), lines.offsets.begin(),
+                      lines.offsets.end());
+      widths_.assign(old_widths, old_widths + lines.first);
+      widths_.insert(widths_.end(), lines.widths.begin(), lines.widths.end());
+    }
+    munmap(old_map, old_map_size);
+    ::close(old_fd);
+  }
+  if (decode_lines_ && lines.first < line_count_) {
+    lock_guard<mutex> lock(decode_mutex_);
+    auto index = lines.first / kDecodeLines;
+    if (index < decoded_.size() && decoded_[index] &&
+        decoded_[index]->lines.size() > lines.first % kDecodeLines) {
+      decoded_[index]->lines.resize(lines.first % kDecodeLines);
+    }
+  }
+  size_ = lines.size;
+  line_count_ = lines.first + lines.widths.size();
+  max_cols_ = lines.max_cols;
+  st_ = lines.st;
+  tail_hash_ = tail_hash(data_, size_);
+}
+
+void source::save_position(const view_position& pos) {
+  position_ = pos;
+  if (cache_path_.empty()) {
+    return;
+  }
+
+  int fd = ::open(cache_path_.c_str(), O_RDWR);
+  if (fd < 0) {
+    return;
+  }
+  cache_header h;
+  if (pread(fd, &h, sizeof(h), 0) == sizeof(h) && h.size == size_ &&
+      h.line_count == line_count_) {
+    uint64_t fields[] = {pos.line, pos.hscroll};
+    pwrite(fd, fields, sizeof(fields), offsetof(cache_header, position_line));
+  }
+  ::close(fd);
+}
+
+void source::unmap_cache() {
+  if (cache_map_) {
+    munmap(cache_map_, cache_map_size_);
+  }
+  if (cache_fd_ >= 0) {
+    ::close(cache_fd_);
+  }
+  cache_map_ = nullptr;
+  cache_map_size_ = 0;
+  cache_fd_ = -1;
+  cached_offsets_ = nullptr;
+  cached_widths_ = nullptr;
+}
@@ -0,0 +1,145 @@
+#ifndef SOURCE_H
+#define SOURCE_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "encoding.h"
+
+struct cache_header;
+
+// View position stored in the index cache
+struct view_position {
+  uint64_t line = 0;
+  uint64_t hscroll = 0;
+};
+
+// Lines appended to a file, found by source::scan_appended() and taken in by
+// source::append(). They replace the lines from `first`, which is the last
+// line when it didn't end with a newline. `offsets` ends with where the next
+// line would start.
+struct appended_lines {
+  struct stat st = {};
+  size_t size = 0;
+  size_t first = 0;
+  bool rewritten = false;  // written to a new cache file
+  std::vector<uint64_t> offsets;
+  std::vector<uint32_t> widths;
+  size_t max_cols = 0;
+};
+
+// Text of a document, either a mapped file or a buffer read from a stream,
+// with the offset and display width of every line. Text in other encodings
+// is converted to UTF-8: Shift_JIS and EUC-JP files stay mapped and their
+// lines are converted a block at a time as they're used, while UTF-16 is
+// converted as it's loaded. For files the index is
+// cached under $XDG_CACHE_HOME/immersion and used from there, so reopening a
+// file maps the cache instead of rescanning, and only indexes what was
+// appended since, adding it to the cache in place. A file that is open can
+// be extended the same way as it grows.
+class source {
+ public:
+  source() = default;
+  source(source&& other) noexcept;
+  source& operator=(source&& other) noexcept;
+  source(const source&) = delete;
+  source& operator=(const source&) = delete;
+  ~source();
+
+  // Opens a file. Indexing it stops, and it fails, once `cancelled` is set.
+  bool open(const std::string& path,
+            const std::atomic<bool>* cancelled = nullptr);
+  void read(int fd);
+  void assign(std::vector<char> buffer);
+  void close();
+  bool scan_appended(appended_lines& result) const;
+  void append(const appended_lines& lines);
+
+  size_t line_count() const { return line_count_; }
+  std::string_view line(size_t i) const {
+    return decode_lines_ ? decoded_line(i) : raw_line(i);
+  }
+  size_t width(size_t i) const { return widths()[i]; }
+  size_t max_cols() const { return max_cols_; }
+  size_t memory_usage() const;
+
+  // Whether the index is mapped from the cache rather than held in memory
+  bool cached() const { return cached_offsets_ != nullptr; }
+
+  // Position saved when the file was last closed
+  const view_position& position() const { return position_; }
+  void save_position(const view_position& pos);
+
+ private:
+  const uint64_t* offsets() const {
+    return cached_offsets_ ? cached_offsets_ : offsets_.data();
+  }
+  const uint32_t* widths() const {
+    return cached_widths_ ? cached_widths_ : widths_.data();
+  }
+  static const size_t kDecodeLines = 256;
+
+  // Lines of a block, either in `texts` or, for ASCII, in the mapped file
+  struct decoded_block {
+    std::vector<std::vector<char>> texts;
+    std::vector<std::string_view> lines;
+  };
+
+  std::string_view raw_line(size_t i) const {
+    auto offsets = this->offsets();
+    return std::string_view(data_ + offsets[i],
+                            offsets[i + 1] - offsets[i] - 1);
+  }
+  std::string_view decoded_line(size_t i) const;
+  void decode();
+  bool index(size_t from, const std::atomic<bool>* cancelled = nullptr);
+  const cache_header* map_cache();
+  bool load_cache(const struct stat& st, const std::atomic<bool>* cancelled);
+  void save_cache(const struct stat& st);
+  bool append_cache(const struct stat& st, size_t size, size_t lines,
+                    const std::vector<uint64_t>& offsets,
+                    const std::vector<uint32_t>& widths,
+                    size_t max_cols) const;
+  bool write_cache(const struct stat& st, size_t size, size_t lines,
+                   const std::vector<uint64_t>& offsets,
+                   const std::vector<uint32_t>& widths,
+                   size_t max_cols) const;
+  void unmap_cache();
+
+  const char* data_ = nullptr;
+  size_t size_ = 0;
+  void* map_ = nullptr;
+  size_t map_size_ = 0;
+  std::vector<char> buffer_;
+  encoding enc_ = encoding::utf8;
+  bool decode_lines_ = false;
+  mutable std::mutex decode_mutex_;
+  mutable std::vector<std::unique_ptr<decoded_block>> decoded_;
+
+  // Line i spans [offsets[i], offsets[i + 1] - 1), leaving out the newline.
+  // The arrays either point into the mapped cache or are owned.
+  size_t line_count_ = 0;
+  size_t max_cols_ = 0;
+  std::vector<uint64_t> offsets_;
+  std::vector<uint32_t> widths_;
+  const uint64_t* cached_offsets_ = nullptr;
+  const uint32_t* cached_widths_ = nullptr;
+  void* cache_map_ = nullptr;
+  size_t cache_map_size_ = 0;
+  int cache_fd_ = -1;
+
+  std::string path_;
+  std::string cache_path_;
+  view_position position_;
+  struct stat st_ = {};
+  uint64_t tail_hash_ = 0;
+};
+
+#endif /* SOURCE_H */
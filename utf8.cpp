@@ -332,21 +332,38 @@ static unsigned long combiningCharTable[] = {
 static unsigned long combiningCharTableSize =
     sizeof(combiningCharTable) / sizeof(combiningCharTable[0]);
 
-/* Check if the code is a wide character
+/* Check if the code is a wide character. The table is sorted, so it's
+ * searched by bisection.
  */
 static int isWideChar(unsigned long cp) {
-  size_t i;
-  for (i = 0; i < wideCharTableSize; i++)
-    if (wideCharTable[i][0] <= cp && cp <= wideCharTable[i][1]) return 1;
+  size_t lo = 0, hi = wideCharTableSize;
+  if (cp < wideCharTable[0][0]) return 0;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (cp < wideCharTable[mid][0])
+      hi = mid;
+    else if (cp > wideCharTable[mid][1])
+      lo = mid + 1;
+    else
+      return 1;
+  }
   return 0;
 }
 
 /* Check if the code is a combining character
  */
 static int isCombiningChar(unsigned long cp) {
-  size_t i;
-  for (i = 0; i < combiningCharTableSize; i++)
-    if (combiningCharTable[i] == cp) return 1;
+  size_t lo = 0, hi = combiningCharTableSize;
+  if (cp < combiningCharTable[0]) return 0;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (cp < combiningCharTable[mid])
+      hi = mid;
+    else if (cp > combiningCharTable[mid])
+      lo = mid + 1;
+    else
+      return 1;
+  }
   return 0;
 }
 
@@ -0,0 +1,434 @@
+#include "view.h"
+
+#include <algorithm>
+
+#include "layout.h"
+
+using namespace std;
+
+view_layout::view_layout(shared_ptr<const source> src,
+                         const layout_options& opts)
+    : src_(move(src)), opts_(opts) {
+  auto line_count = src_->line_count();
+  blocks_.resize((line_count + kBlockLines - 1) / kBlockLines);
+  if (opts_.linespace) {
+    while (first_text_line_ < line_count &&
+           src_->line(first_text_line_).empty()) {
+      first_text_line_++;
+    }
+  }
+}
+
+// Lines longer than kSegmentBytes are folded a segment at a time. In chop
+// mode a line is a single display line however long it is.
+bool view_layout::is_huge(size_t line) const {
+  return !opts_.chop && src_->line(line).size() > kSegmentBytes;
+}
+
+size_t view_layout::segment_count(size_t line) const {
+  if (!is_huge(line)) {
+    return 1;
+  }
+  return (src_->line(line).size() + kSegmentBytes - 1) / kSegmentBytes;
+}
+
+size_t view_layout::segment_begin(size_t line, size_t index) const {
+  return segment_start(src_->line(line), index * kSegmentBytes);
+}
+
+size_t view_layout::row_count(size_t line, size_t segment) {
+  if (line >= src_->line_count()) {
+    return 0;
+  }
+  if (is_huge(line)) {
+    return get_segment(line, segment)->rows.size();
+  }
+  auto blk = get_block(line / kBlockLines);
+  auto i = line % kBlockLines;
+  return blk->first_rows[i + 1] - blk->first_rows[i];
+}
+
+display_row view_layout::row(const anchor& a) {
+  if (is_huge(a.line)) {
+    return get_segment(a.line, a.segment)->rows[a.row];
+  }
+  auto blk = get_block(a.line / kBlockLines);
+  return blk->rows[blk->first_rows[a.line % kBlockLines] + a.row];
+}
+
+// Styled runs of a display line, kept for the display lines used last
+shared_ptr<const styled_row> view_layout::styled(const anchor& a) {
+  row_key key{a.line, a.segment, a.row};
+  {
+    lock_guard<mutex> lock(mutex_);
+    auto it = styled_rows_.find(key);
+    if (it != styled_rows_.end()) {
+      styled_uses_.splice(styled_uses_.begin(), styled_uses_, it->second.use);
+      return it->second.row;
+    }
+  }
+
+  auto result = make_shared<styled_row>();
+  auto dr = row(a);
+  if (!dr.is_spacer()) {
+    auto text = src_->line(a.line).substr(dr.offset, dr.length);
+    for (auto& glyph : attribute_line(text, row_style(a, dr))) {
+      auto ch = text.substr(glyph.offset, glyph.length);
+      if (!result->empty() && result->back().style.attrs == glyph.attrs &&
+          result->back().style.fg == glyph.fg &&
+          result->back().style.bg == glyph.bg) {
+        result->back().text += ch;
+      } else {
+        result->push_back(styled_run{string(ch), glyph});
+      }
+    }
+  }
+
+  lock_guard<mutex> lock(mutex_);
+  auto it = styled_rows_.find(key);
+  if (it != styled_rows_.end()) {
+    return it->second.row;
+  }
+  styled_uses_.push_front(key);
+  styled_rows_[key] = styled_entry{result, styled_uses_.begin()};
+  if (styled_rows_.size() > kCachedRows) {
+    styled_rows_.erase(styled_uses_.back());
+    styled_uses_.pop_back();
+  }
+  return result;
+}
+
+// Style a display line starts in, as set by the escape sequences before it
+// in its source line. A segment of a huge line is only scanned from its own
+// start.
+style view_layout::row_style(const anchor& a, const display_row& row) {
+  auto line = src_->line(a.line);
+  if (is_huge(a.line)) {
+    auto begin = segment_begin(a.line, a.segment);
+    auto seg = get_segment(a.line, a.segment);
+    return style_at(line.substr(begin, row.offset - begin), row.offset - begin,
+                    seg->start);
+  }
+  return style_at(line, row.offset);
+}
+
+// Display line of source line `line` that contains byte `offset`
+anchor view_layout::anchor_at(size_t line, size_t offset) {
+  anchor a{line, 0, 0};
+  if (is_huge(line)) {
+    a.segment = min(offset / kSegmentBytes, segment_count(line) - 1);
+    if (a.segment > 0 && offset < segment_begin(line, a.segment)) {
+      a.segment--;
+    }
+  }
+  auto rows = row_count(line, a.segment);
+  for (a.row = rows; a.row > 0; a.row--) {
+    auto dr = row(anchor{line, a.segment, a.row - 1});
+    if (!dr.is_spacer() && dr.offset <= offset) {
+      break;
+    }
+  }
+  a.row = a.row > 0 ? a.row - 1 : 0;
+  return a;
+}
+
+// Moves `a` onto an existing display line, skipping forward past source lines
+// that have none.
+anchor view_layout::normalize(anchor a) {
+  if (a.line >= src_->line_count()) {
+    return end();
+  }
+  a.segment = min(a.segment, segment_count(a.line) - 1);
+  auto rows = row_count(a.line, a.segment);
+  if (rows == 0) {
+    return next_segment(a) ? a : end();
+  }
+  a.row = min(a.row, rows - 1);
+  return a;
+}
+
+anchor view_layout::end() {
+  anchor a{src_->line_count(), 0, 0};
+  return prev_segment(a) ? a : anchor();
+}
+
+// Moves `a` to the first display line of the next segment that has any
+bool view_layout::next_segment(anchor& a) {
+  auto line_count = src_->line_count();
+  auto line = a.line;
+  auto seg = a.segment + 1;
+  while (line < line_count) {
+    if (seg >= segment_count(line)) {
+      line++;
+      seg = 0;
+    } else if (row_count(line, seg) > 0) {
+      a = anchor{line, seg, 0};
+      return true;
+    } else {
+      seg++;
+    }
+  }
+  return false;
+}
+
+// Moves `a` to the last display line of the previous segment that has any
+bool view_layout::prev_segment(anchor& a) {
+  auto line = a.line;
+  auto seg = a.segment;
+  while (true) {
+    if (seg == 0) {
+      if (line == 0) {
+        return false;
+      }
+      line--;
+      seg = segment_count(line);
+      continue;
+    }
+    seg--;
+    auto rows = row_count(line, seg);
+    if (rows > 0) {
+      a = anchor{line, seg, rows - 1};
+      return true;
+    }
+  }
+}
+
+// Moves `a` by up to `n` display lines and returns how far it got
+size_t view_layout::step(anchor& a, size_t n, bool forward) {
+  size_t moved = 0;
+  while (moved < n) {
+    if (forward) {
+      auto rows = row_count(a.line, a.segment);
+      if (a.row + 1 < rows) {
+        auto k = min(n - moved, rows - 1 - a.row);
+        a.row += k;
+        moved += k;
+        continue;
+      }
+      if (!next_segment(a)) {
+        break;
+      }
+    } else {
+      if (a.row > 0) {
+        auto k = min(n - moved, a.row);
+        a.row -= k;
+        moved += k;
+        continue;
+      }
+      if (!prev_segment(a)) {
+        break;
+      }
+    }
+    moved++;
+  }
+  return moved;
+}
+
+// Number of display lines from `from` to the end, counting up to `limit`
+size_t view_layout::count(anchor from, size_t limit) {
+  if (limit == 0 || row_count(from.line, from.segment) == 0) {
+    return 0;
+  }
+  return 1 + step(from, limit - 1, true);
+}
+
+// Takes in the lines from `from_line` on, which were appended to the source
+// or changed. The block they start in is folded again along with the new
+// ones. It may only be called while complete() isn't running, and the source
+// isn't read meanwhile.
+void view_layout::extend(size_t from_line) {
+  lock_guard<mutex> lock(mutex_);
+  auto line_count = src_->line_count();
+  auto kept = from_line / kBlockLines;
+  for (auto i = kept; i < blocks_.size(); i++) {
+    if (blocks_[i]) {
+      folded_blocks_--;
+    }
+  }
+  blocks_.resize(kept);
+  blocks_.resize((line_count + kBlockLines - 1) / kBlockLines);
+  segments_.erase(segments_.lower_bound(make_pair(from_line, size_t(0))),
+                  segments_.end());
+  segment_styles_.erase(
+      segment_styles_.lower_bound(make_pair(from_line, size_t(0))),
+      segment_styles_.end());
+  for (auto it = styled_uses_.begin(); it != styled_uses_.end();) {
+    if (it->line >= from_line) {
+      styled_rows_.erase(*it);
+      it = styled_uses_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  if (opts_.linespace && first_text_line_ >= from_line) {
+    first_text_line_ = from_line;
+    while (first_text_line_ < line_count &&
+           src_->line(first_text_line_).empty()) {
+      first_text_line_++;
+    }
+  }
+  cancelled_ = false;
+}
+
+// Folds every block, starting from the one with `hint_line` and wrapping
+// around, until done or cancelled.
+void view_layout::complete(size_t hint_line) {
+  auto n = blocks_.size();
+  auto first = n > 0 ? min(hint_line / kBlockLines, n - 1) : 0;
+  for (size_t k = 0; k < n && !cancelled_; k++) {
+    get_block((first + k) % n);
+  }
+}
+
+bool view_layout::completed() {
+  lock_guard<mutex> lock(mutex_);
+  return folded_blocks_ == blocks_.size();
+}
+
+size_t view_layout::memory_usage() {
+  lock_guard<mutex> lock(mutex_);
+  auto size = blocks_.capacity() * sizeof(blocks_[0]);
+  for (auto& blk : blocks_) {
+    if (blk) {
+      size += sizeof(block) + blk->first_rows.capacity() * sizeof(uint32_t) +
+              blk->rows.capacity() * sizeof(display_row);
+    }
+  }
+  for (auto& [_, seg] : segments_) {
+    size += sizeof(segment) + seg->rows.capacity() * sizeof(display_row);
+  }
+  size += segment_styles_.size() * (sizeof(style) + sizeof(size_t) * 6);
+  for (auto& [_, entry] : styled_rows_) {
+    size += sizeof(entry) + sizeof(row_key) * 2;
+    for (auto& run : *entry.row) {
+      size += sizeof(run) + run.text.capacity();
+    }
+  }
+  return size;
+}
+
+shared_ptr<const view_layout::block> view_layout::get_block(size_t index) {
+  {
+    lock_guard<mutex> lock(mutex_);
+    if (blocks_[index]) {
+      return blocks_[index];
+    }
+  }
+  // Folded without the lock, so the worker and the input thread don't wait
+  // for each other. If both fold the same block, the first one wins.
+  auto blk = fold_block(index);
+  lock_guard<mutex> lock(mutex_);
+  if (!blocks_[index]) {
+    blocks_[index] = blk;
+    folded_blocks_++;
+  }
+  return blocks_[index];
+}
+
+shared_ptr<const view_layout::block> view_layout::fold_block(
+    size_t index) const {
+  auto blk = make_shared<block>();
+  auto begin = index * kBlockLines;
+  auto end = min(begin + kBlockLines, src_->line_count());
+  blk->first_rows.reserve(end - begin + 1);
+  for (auto i = begin; i < end; i++) {
+    blk->first_rows.push_back(blk->rows.size());
+    if (is_huge(i)) {
+      continue;
+    }
+    auto line = src_->line(i);
+    if (opts_.linespace) {
+      if (line.empty()) continue;
+      if (i > first_text_line_) {
+        blk->rows.push_back(display_row{display_row::kSpacer, 0});
+      }
+    }
+    if (opts_.chop) {
+      blk->rows.push_back(display_row{0, (uint32_t)line.size()});
+    } else {
+      for (auto& span : fold_line(line, opts_.cols, opts_.word_warp)) {
+        blk->rows.push_back(
+            display_row{(uint32_t)span.offset, (uint32_t)span.length});
+      }
+    }
+  }
+  blk->first_rows.push_back(blk->rows.size());
+  return blk;
+}
+
+shared_ptr<const view_layout::segment> view_layout::get_segment(size_t line,
+                                                                size_t index) {
+  auto key = make_pair(line, index);
+  {
+    lock_guard<mutex> lock(mutex_);
+    auto it = segments_.find(key);
+    if (it != segments_.end()) {
+      it->second->last_used = ++segment_uses_;
+      return it->second;
+    }
+  }
+  auto seg = fold_segment(line, index);
+  lock_guard<mutex> lock(mutex_);
+  auto& slot = segments_[key];
+  if (!slot) {
+    slot = seg;
+  }
+  slot->last_used = ++segment_uses_;
+  if (segments_.size() > kCachedSegments) {
+    auto lru = min_element(segments_.begin(), segments_.end(),
+                           [](auto& a, auto& b) {
+                             return a.second->last_used < b.second->last_used;
+                           });
+    segments_.erase(lru);
+  }
+  return slot;
+}
+
+// Folds a segment of a huge line on its own, so a display line may end
+// early at the end of a segment.
+shared_ptr<view_layout::segment> view_layout::fold_segment(size_t line,
+                                                           size_t index) {
+  auto seg = make_shared<segment>();
+  if (index == 0 && opts_.linespace && line > first_text_line_) {
+    seg->rows.push_back(display_row{display_row::kSpacer, 0});
+  }
+  auto begin = segment_begin(line, index);
+  auto end = segment_begin(line, index + 1);
+  seg->start = segment_style(line, index);
+  auto text = src_->line(line).substr(begin, end - begin);
+  for (auto& span : fold_line(text, opts_.cols, opts_.word_warp)) {
+    seg->rows.push_back(
+        display_row{(uint32_t)(begin + span.offset), (uint32_t)span.length});
+  }
+  return seg;
+}
+
+// Style a segment of a huge line starts in. It's carried on from the nearest
+// segment before it whose style is known, and the styles of the segments in
+// between are kept on the way, so each segment is scanned once.
+style view_layout::segment_style(size_t line, size_t index) {
+  size_t from = 0;
+  style st;
+  {
+    lock_guard<mutex> lock(mutex_);
+    auto it = segment_styles_.upper_bound(make_pair(line, index));
+    if (it != segment_styles_.begin() && prev(it)->first.first == line) {
+      from = prev(it)->first.second;
+      st = prev(it)->second;
+    }
+  }
+  auto text = src_->line(line);
+  auto pos = segment_begin(line, from);
+  vector<pair<size_t, style>> found;
+  for (auto i = from + 1; i <= index; i++) {
+    auto next = segment_begin(line, i);
+    st = style_at(text.substr(pos, next - pos), next - pos, st);
+    found.emplace_back(i, st);
+    pos = next;
+  }
+  lock_guard<mutex> lock(mutex_);
+  for (auto& [i, s] : found) {
+    segment_styles_.emplace(make_pair(line, i), s);
+  }
+  return st;
+}
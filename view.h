@@ -0,0 +1,158 @@
+#ifndef VIEW_H
+#define VIEW_H
+
+#include <stdint.h>
+
+#include <atomic>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "immersion.h"
+#include "layout.h"
+#include "source.h"
+
+struct layout_options {
+  size_t cols = 0;
+  bool linespace = false;
+  bool chop = false;
+  bool word_warp = false;
+
+  bool operator==(const layout_options& other) const {
+    return cols == other.cols && linespace == other.linespace &&
+           chop == other.chop && word_warp == other.word_warp;
+  }
+  bool operator!=(const layout_options& other) const {
+    return !(*this == other);
+  }
+};
+
+// A display line: `length` bytes at `offset` in its source line. The blank
+// lines of line spacing have `offset` set to `kSpacer`.
+struct display_row {
+  static const uint32_t kSpacer = UINT32_MAX;
+
+  uint32_t offset;
+  uint32_t length;
+
+  bool is_spacer() const { return offset == kSpacer; }
+};
+
+// Display line `row` of a segment of source line `line`. Positions are kept
+// this way rather than as display line numbers, so they stay valid while a
+// layout is incomplete and carry over to a layout of another width. Only
+// lines longer than kSegmentBytes have more than one segment.
+struct anchor {
+  size_t line = 0;
+  size_t segment = 0;
+  size_t row = 0;
+};
+
+// Text of a display line in runs of one style. Only the attributes and
+// colors of `style` are used.
+struct styled_run {
+  std::string text;
+  imm_glyph style;
+};
+
+using styled_row = std::vector<styled_run>;
+
+// Folded display lines of a source, computed in blocks of lines on demand.
+// Whatever is on screen gets folded first by the input thread, while
+// complete() fills in the rest on a worker thread until it's cancelled.
+// Segments of huge lines are only folded when they're reached, and just the
+// recently used ones are kept, as are the styled runs of recently drawn or
+// prefetched display lines. When lines are appended to the source, only
+// those are folded anew.
+class view_layout {
+ public:
+  view_layout(std::shared_ptr<const source> src, const layout_options& opts);
+
+  const layout_options& options() const { return opts_; }
+  const source& src() const { return *src_; }
+
+  size_t segment_count(size_t line) const;
+  size_t row_count(size_t line, size_t segment);
+  display_row row(const anchor& a);
+  std::shared_ptr<const styled_row> styled(const anchor& a);
+  anchor anchor_at(size_t line, size_t offset);
+
+  anchor normalize(anchor a);
+  anchor end();
+  size_t step(anchor& a, size_t n, bool forward);
+  size_t count(anchor from, size_t limit);
+
+  void extend(size_t from_line);
+  void complete(size_t hint_line);
+  void cancel() { cancelled_ = true; }
+  bool completed();
+  size_t memory_usage();
+
+ private:
+  static const size_t kBlockLines = 256;
+  static const size_t kCachedSegments = 64;
+  static const size_t kCachedRows = 4096;
+
+  struct block {
+    std::vector<uint32_t> first_rows;
+    std::vector<display_row> rows;
+  };
+
+  struct row_key {
+    size_t line, segment, row;
+    bool operator==(const row_key& other) const {
+      return line == other.line && segment == other.segment &&
+             row == other.row;
+    }
+  };
+
+  struct row_key_hash {
+    size_t operator()(const row_key& key) const {
+      return std::hash<size_t>()(key.line * 0x9e3779b97f4a7c15 ^
+                                 key.segment << 20 ^ key.row);
+    }
+  };
+
+  struct styled_entry {
+    std::shared_ptr<const styled_row> row;
+    std::list<row_key>::iterator use;
+  };
+
+  struct segment {
+    std::vector<display_row> rows;
+    style start;  // style in effect where the segment begins
+    size_t last_used = 0;
+  };
+
+  bool is_huge(size_t line) const;
+  style row_style(const anchor& a, const display_row& row);
+  size_t segment_begin(size_t line, size_t index) const;
+  bool next_segment(anchor& a);
+  bool prev_segment(anchor& a);
+
+  std::shared_ptr<const block> get_block(size_t index);
+  std::shared_ptr<const block> fold_block(size_t index) const;
+  std::shared_ptr<const segment> get_segment(size_t line, size_t index);
+  std::shared_ptr<segment> fold_segment(size_t line, size_t index);
+  style segment_style(size_t line, size_t index);
+
+  std::shared_ptr<const source> src_;
+  layout_options opts_;
+  size_t first_text_line_ = 0;
+
+  std::mutex mutex_;
+  std::vector<std::shared_ptr<const block>> blocks_;
+  size_t folded_blocks_ = 0;
+  std::map<std::pair<size_t, size_t>, std::shared_ptr<segment>> segments_;
+  size_t segment_uses_ = 0;
+  std::map<std::pair<size_t, size_t>, style> segment_styles_;
+  std::unordered_map<row_key, styled_entry, row_key_hash> styled_rows_;
+  std::list<row_key> styled_uses_;  // most recently used first
+  std::atomic<bool> cancelled_{false};
+};
+
+#endif /* VIEW_H */